@@ -0,0 +1,140 @@
+/*------------------------------------------------------------
+ *  scan-bench: end-of-headers scanner micro-benchmark
+ *
+ *  Compares the original byte loop (rescanning the whole
+ *  buffer after every read) with each scanner in scan.h this
+ *  CPU supports, for a head that arrives all at once and one
+ *  that trickles in over many small reads.
+ *
+ *    snooze-scan-bench [HEAD_BYTES] [CHUNK_BYTES]
+ *-----------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../scan.h"
+
+/* The scanner snooze used before scan.h, kept as the baseline */
+static size_t legacy_headers_end(const char *buf, size_t len)
+{
+    if (len < 4) return 0;
+    for (size_t i = 0; i + 3 < len; i++) {
+        if (buf[i] == '\r' && buf[i+1] == '\n' && buf[i+2] == '\r' && buf[i+3] == '\n')
+            return i + 4;
+    }
+    return 0;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* A plausible request head of about `size` bytes */
+static char *make_head(size_t size)
+{
+    char *buf = (char*)malloc(size + 64);
+    if (!buf) { perror("malloc"); exit(EXIT_FAILURE); }
+
+    size_t n = (size_t)snprintf(buf, size, "GET /some/path?q=1 HTTP/1.1\r\nHost: example.com\r\n");
+    for (int i = 0; n + 64 < size; i++)
+        n += (size_t)snprintf(buf + n, size - n, "X-Header-%d: value-%08d-abcdefghij\r\n", i, i * 7919);
+    memcpy(buf + n, "\r\n", 3);
+    return buf;
+}
+
+static volatile size_t sink;
+
+static void bench(const char *name, scan_fn fn, const char *head, size_t len, size_t chunk)
+{
+    size_t iters = (64u << 20) / len + 1;       /* ~64 MiB of head per run */
+    double t0 = now_s();
+
+    for (size_t it = 0; it < iters; it++) {
+        size_t scanned = 0, end = 0;
+        for (size_t have = chunk < len ? chunk : len; ; have += chunk) {
+            if (have > len) have = len;
+            if (fn) {
+                scan_crlfcrlf = fn;
+                end = find_headers_end(head, have, &scanned);
+            } else {
+                end = legacy_headers_end(head, have);
+            }
+            if (end || have == len) break;
+        }
+        if (end != len) { fprintf(stderr, "%s: wrong result %zu\n", name, end); exit(EXIT_FAILURE); }
+        sink += end;
+    }
+
+    double ns = (now_s() - t0) * 1e9 / (double)iters;
+    printf("  %-8s %10.1f ns/head %8.2f GB/s\n", name, ns, (double)len / ns);
+}
+
+/* Every scanner must agree with the byte loop on random input */
+static void self_check(void)
+{
+    char buf[512];
+    srand(1);
+    for (int round = 0; round < 20000; round++) {
+        size_t len = (size_t)(rand() % (int)sizeof(buf));
+        for (size_t i = 0; i < len; i++) buf[i] = "\r\nab"[rand() % 4];
+
+        size_t want = legacy_headers_end(buf, len), scanned;
+        scan_fn fns[] = {
+            scan_crlfcrlf_scalar,
+#ifdef SCAN_X86
+            scan_crlfcrlf_sse2,
+            __builtin_cpu_supports("avx2") ? scan_crlfcrlf_avx2 : scan_crlfcrlf_sse2,
+#endif
+#ifdef SCAN_NEON
+            scan_crlfcrlf_neon,
+#endif
+        };
+        for (size_t f = 0; f < sizeof(fns) / sizeof(fns[0]); f++) {
+            scan_crlfcrlf = fns[f];
+            scanned = 0;
+            if (find_headers_end(buf, len, &scanned) != want) {
+                fprintf(stderr, "scanner %zu disagrees on round %d\n", f, round);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t len   = argc > 1 ? strtoull(argv[1], NULL, 10) : 4096;
+    size_t chunk = argc > 2 ? strtoull(argv[2], NULL, 10) : 64;
+    if (len < 128) len = 128;
+    if (chunk < 1) chunk = 1;
+
+    const char *best = scan_init();
+    scan_fn dispatched = scan_crlfcrlf;
+    self_check();
+
+    char *head = make_head(len);
+    len = strlen(head);
+
+    for (int pass = 0; pass < 2; pass++) {
+        size_t step = pass ? chunk : len;
+        printf("%zu-byte head, %s:\n", len, pass ? "arriving in chunks" : "one read");
+        if (pass) printf("  (%zu bytes per read)\n", chunk);
+        bench("legacy", NULL, head, len, step);
+        bench("scalar", scan_crlfcrlf_scalar, head, len, step);
+#ifdef SCAN_X86
+        bench("sse2", scan_crlfcrlf_sse2, head, len, step);
+        if (dispatched == scan_crlfcrlf_avx2) bench("avx2", scan_crlfcrlf_avx2, head, len, step);
+#endif
+#ifdef SCAN_NEON
+        bench("neon", scan_crlfcrlf_neon, head, len, step);
+#endif
+    }
+    printf("snooze uses: %s\n", best);
+
+    free(head);
+    return 0;
+}
@@ -0,0 +1,564 @@
+/*------------------------------------------------------------
+ *  snooze-bench: HTTP load generator
+ *
+ *  Each thread drives its share of the connections from one
+ *  edge-triggered epoll loop, one request in flight per
+ *  connection (keep-alive, reconnecting when the server closes).
+ *
+ *    closed loop  (default) every connection sends its next
+ *                 request as soon as the previous answer is in.
+ *    open loop    (--rate=N) requests are scheduled at a fixed
+ *                 total rate. Latency is measured from the time
+ *                 a request was *due*, not when it could be sent,
+ *                 so a stalled server is charged for the requests
+ *                 it held up (coordinated-omission correction).
+ *                 The loop sleeps on an absolute timerfd with
+ *                 minimal timer slack, so the generator's own
+ *                 wake-up lateness stays in the microseconds.
+ *
+ *  Latencies go into log-linear histograms (~3% precision), one
+ *  per thread, merged for the report.
+ *-----------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../scan.h"
+
+#define MAX_EVENTS  256
+#define RESP_BUF    65536
+
+/*------------------------------------------------------------
+ *  Latency histogram
+ *
+ *  Values below 2*SUB ns are exact; above that each power of
+ *  two is split into SUB linear buckets.
+ *-----------------------------------------------------------*/
+#define SUB_BITS     5
+#define SUB          (1u << SUB_BITS)
+#define HIST_BUCKETS (2 * SUB + 58 * SUB)
+
+struct hist {
+    uint64_t count[HIST_BUCKETS];
+    uint64_t total, max;
+};
+
+static unsigned hist_index(uint64_t v)
+{
+    if (v < 2 * SUB) return (unsigned)v;
+    unsigned shift = (unsigned)(63 - __builtin_clzll(v)) - SUB_BITS;
+    unsigned i = 2 * SUB + (shift - 1) * SUB + (unsigned)(v >> shift) - SUB;
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+/* Highest value that lands in bucket i */
+static uint64_t hist_value(unsigned i)
+{
+    if (i < 2 * SUB) return i;
+    unsigned shift = (i - 2 * SUB) / SUB + 1;
+    uint64_t top = SUB + (i - 2 * SUB) % SUB;
+    return ((top + 1) << shift) - 1;
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+    h->count[hist_index(v)]++;
+    h->total++;
+    if (v > h->max) h->max = v;
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src)
+{
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) dst->count[i] += src->count[i];
+    dst->total += src->total;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+static uint64_t hist_percentile(const struct hist *h, double p)
+{
+    uint64_t want = (uint64_t)((double)h->total * p / 100.0 + 0.5), seen = 0;
+    if (want == 0) want = 1;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen >= want) {
+            uint64_t v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/*------------------------------------------------------------
+ *  Configuration
+ *-----------------------------------------------------------*/
+struct bench_config {
+    const char *host;
+    int         port;
+    const char *path;
+    int         threads;
+    int         connections;
+    double      duration;        /* seconds                         */
+    double      rate;            /* total req/s; 0: closed loop     */
+    int         close;           /* Connection: close per request   */
+};
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [OPTIONS]\n\n", prog);
+    printf("Options:\n");
+    printf("  -a, --host=ADDR         IPv4 address of the server (default: 127.0.0.1)\n");
+    printf("  -p, --port=PORT         Server port (default: 80)\n");
+    printf("  -u, --path=PATH         Request target (default: /)\n");
+    printf("  -t, --threads=N         Load-generating threads (default: 2)\n");
+    printf("  -c, --connections=N     Concurrent connections (default: 64)\n");
+    printf("  -d, --duration=SECONDS  Length of the run (default: 10)\n");
+    printf("  -r, --rate=N            Open loop at N requests/s in total\n"
+           "                          (default: closed loop)\n");
+    printf("      --close             Send Connection: close (new connection per request)\n");
+    printf("  -h, --help              Show this help message\n");
+}
+
+static void parse_arguments(int argc, char *argv[], struct bench_config *cfg)
+{
+    static const struct option long_opts[] = {
+        { "host",        required_argument, NULL, 'a' },
+        { "port",        required_argument, NULL, 'p' },
+        { "path",        required_argument, NULL, 'u' },
+        { "threads",     required_argument, NULL, 't' },
+        { "connections", required_argument, NULL, 'c' },
+        { "duration",    required_argument, NULL, 'd' },
+        { "rate",        required_argument, NULL, 'r' },
+        { "close",       no_argument,       NULL, 'C' },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    cfg->host        = "127.0.0.1";
+    cfg->port        = 80;
+    cfg->path        = "/";
+    cfg->threads     = 2;
+    cfg->connections = 64;
+    cfg->duration    = 10;
+    cfg->rate        = 0;
+    cfg->close       = 0;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "a:p:u:t:c:d:r:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'a': cfg->host        = optarg;       break;
+            case 'p': cfg->port        = atoi(optarg); break;
+            case 'u': cfg->path        = optarg;       break;
+            case 't': cfg->threads     = atoi(optarg); break;
+            case 'c': cfg->connections = atoi(optarg); break;
+            case 'd': cfg->duration    = atof(optarg); break;
+            case 'r': cfg->rate        = atof(optarg); break;
+            case 'C': cfg->close       = 1;            break;
+            case 'h': usage(argv[0]); exit(EXIT_SUCCESS);
+            default:
+                fprintf(stderr, "use -h or --help for help\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (cfg->threads < 1 || cfg->connections < 1 || cfg->duration <= 0 || cfg->rate < 0) {
+        fprintf(stderr, "threads, connections and duration must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    if (cfg->threads > cfg->connections) cfg->threads = cfg->connections;
+}
+
+/*------------------------------------------------------------
+ *  Connections
+ *-----------------------------------------------------------*/
+static struct sockaddr_in server;
+static char   request[1024];
+static size_t request_len;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+struct bconn {
+    int       fd;
+    int       connected;
+    int       busy;              /* request in flight                 */
+    size_t    sent;              /* bytes of the request written      */
+    uint64_t  start_ns;          /* when the request was due / sent   */
+    uint64_t  next_ns;           /* open loop: next due time          */
+    uint64_t  offset_ns;         /* open loop: phase within interval  */
+
+    char      buf[RESP_BUF];     /* response head (body is skipped)   */
+    size_t    len, scanned, hdr_end;
+    size_t    body_left;
+    int       server_closes;
+};
+
+struct thread {
+    pthread_t            tid;
+    const struct bench_config *cfg;
+    struct bconn        *conns;
+    int                  nconns;
+    int                  ep;
+    int                  tfd;            /* wake-up timer, data.ptr NULL */
+    uint64_t             tfd_ns;         /* when it is armed to fire     */
+    uint64_t             interval_ns;    /* open loop, per connection */
+    uint64_t             deadline_ns;
+    struct hist          hist;
+    uint64_t             errors, connects;
+};
+
+static int bconn_open(struct thread *t, struct bconn *c)
+{
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) { perror("socket"); return -1; }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(c->fd, (struct sockaddr*)&server, sizeof(server)) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    c->connected = 0;
+    c->len = c->scanned = c->hdr_end = c->body_left = 0;
+    c->sent = 0;
+    t->connects++;
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+    return epoll_ctl(t->ep, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+/* Drops the connection; a request still in flight counts as an error */
+static void bconn_reset(struct thread *t, struct bconn *c)
+{
+    if (c->busy) t->errors++;
+    c->busy = 0;
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    while (bconn_open(t, c) < 0 && now_ns() < t->deadline_ns) {
+        t->errors++;
+        usleep(1000);
+    }
+}
+
+/* Writes what is left of the request; -1 on a hard error */
+static int bconn_flush(struct bconn *c)
+{
+    while (c->busy && c->connected && c->sent < request_len) {
+        ssize_t n = send(c->fd, request + c->sent, request_len - c->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->sent += (size_t)n;
+    }
+    return 0;
+}
+
+static int bconn_issue(struct bconn *c, uint64_t due_ns)
+{
+    c->busy     = 1;
+    c->sent     = 0;
+    c->start_ns = due_ns;
+    return bconn_flush(c);
+}
+
+/* Is a Content-Length header present? Fills *len. */
+static int head_content_length(const char *head, size_t hlen, size_t *len)
+{
+    static const char name[] = "\ncontent-length:";
+    for (size_t i = 0; i + sizeof(name) - 1 <= hlen; i++) {
+        if (strncasecmp(head + i, name, sizeof(name) - 1) == 0) {
+            *len = strtoull(head + i + sizeof(name) - 1, NULL, 10);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int head_closes(const char *head, size_t hlen)
+{
+    static const char name[] = "\nconnection: close";
+    for (size_t i = 0; i + sizeof(name) - 1 <= hlen; i++)
+        if (strncasecmp(head + i, name, sizeof(name) - 1) == 0) return 1;
+    return 0;
+}
+
+/*
+ * Consumes response bytes. Returns 1 when a response completed,
+ * 0 if more is needed and -1 on a malformed response.
+ */
+static int bconn_parse(struct thread *t, struct bconn *c)
+{
+    if (!c->hdr_end) {
+        c->hdr_end = find_headers_end(c->buf, c->len, &c->scanned);
+        if (!c->hdr_end) return c->len == sizeof(c->buf) ? -1 : 0;
+
+        if (c->len < 12 || memcmp(c->buf, "HTTP/1.", 7) != 0) return -1;
+        int status = atoi(c->buf + 9);
+        if (status != 200 && status != 304) t->errors++;
+
+        c->body_left = 0;
+        if (status != 304) head_content_length(c->buf, c->hdr_end, &c->body_left);
+        c->server_closes = head_closes(c->buf, c->hdr_end);
+
+        /* keep only body bytes that already arrived */
+        size_t extra = c->len - c->hdr_end;
+        size_t take  = extra < c->body_left ? extra : c->body_left;
+        c->body_left -= take;
+        c->len = extra - take;                         /* no pipelining: stray bytes */
+    } else {
+        size_t take = c->len < c->body_left ? c->len : c->body_left;
+        c->body_left -= take;
+        c->len -= take;
+    }
+    return c->body_left == 0;
+}
+
+/* Reads until EAGAIN; returns 1 on a complete response, -1 on EOF/error */
+static int bconn_read(struct thread *t, struct bconn *c)
+{
+    for (;;) {
+        char  *dst  = c->hdr_end ? c->buf : c->buf + c->len;
+        size_t room = c->hdr_end ? sizeof(c->buf) : sizeof(c->buf) - c->len;
+        ssize_t n = recv(c->fd, dst, room, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (n == 0) return -1;
+        c->len = c->hdr_end ? (size_t)n : c->len + (size_t)n;
+        if (!c->busy) continue;                         /* unsolicited: ignore */
+
+        int r = bconn_parse(t, c);
+        if (r != 0) return r;
+    }
+}
+
+static void response_done(struct thread *t, struct bconn *c, uint64_t now)
+{
+    hist_add(&t->hist, now - c->start_ns);
+    c->busy = 0;
+    c->len = c->scanned = c->hdr_end = 0;
+
+    if (c->server_closes || t->cfg->close) {
+        close(c->fd);
+        c->fd = -1;
+        bconn_reset(t, c);
+    }
+}
+
+/* Sends the next request if one is due (always, in closed loop) */
+static void maybe_issue(struct thread *t, struct bconn *c, uint64_t now)
+{
+    if (c->busy || !c->connected || c->fd < 0 || now >= t->deadline_ns) return;
+    if (t->interval_ns == 0) {
+        if (bconn_issue(c, now) < 0) bconn_reset(t, c);
+    } else if (now >= c->next_ns) {
+        uint64_t due = c->next_ns;
+        c->next_ns += t->interval_ns;
+        if (bconn_issue(c, due) < 0) bconn_reset(t, c);
+    }
+}
+
+static void *thread_main(void *arg)
+{
+    struct thread *t = (struct thread*)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    t->ep = epoll_create1(EPOLL_CLOEXEC);
+    if (t->ep < 0) { perror("epoll_create1"); return NULL; }
+
+    /* epoll_wait() only sleeps in whole milliseconds: far too coarse
+     * to pace requests, so a timerfd wakes the loop instead */
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+    t->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event tev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (t->tfd < 0 || epoll_ctl(t->ep, EPOLL_CTL_ADD, t->tfd, &tev) < 0) {
+        perror("timerfd");
+        return NULL;
+    }
+    t->tfd_ns = 0;
+
+    for (int i = 0; i < t->nconns; i++) {
+        struct bconn *c = &t->conns[i];
+        c->fd = -1;
+        /* spread the open-loop schedule evenly across connections */
+        c->offset_ns = (t->interval_ns * (uint64_t)i) / (uint64_t)t->nconns;
+        bconn_reset(t, c);
+    }
+
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= t->deadline_ns) break;
+
+        /* sleep until the next due request or the end of the run */
+        uint64_t wake = t->deadline_ns;
+        if (t->interval_ns) {
+            for (int i = 0; i < t->nconns; i++) {
+                const struct bconn *c = &t->conns[i];
+                if (!c->busy && c->connected && c->next_ns < wake) wake = c->next_ns;
+            }
+        }
+        int timeout = -1;
+        if (wake <= now) {
+            timeout = 0;
+        } else if (wake != t->tfd_ns) {
+            struct itimerspec its = {
+                .it_value = { .tv_sec  = (time_t)(wake / 1000000000u),
+                              .tv_nsec = (long)(wake % 1000000000u) },
+            };
+            timerfd_settime(t->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+            t->tfd_ns = wake;
+        }
+
+        int n = epoll_wait(t->ep, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) { perror("epoll_wait"); break; }
+
+        now = now_ns();
+        for (int i = 0; i < n; i++) {
+            struct bconn *c = (struct bconn*)events[i].data.ptr;
+            if (!c) {                          /* the timer: just clear it */
+                uint64_t ticks;
+                ssize_t r = read(t->tfd, &ticks, sizeof(ticks));
+                (void)r;                       /* EAGAIN: already cleared */
+                continue;
+            }
+            if (c->fd < 0) continue;
+
+            if (!c->connected && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err) { t->errors++; bconn_reset(t, c); continue; }
+                c->connected = 1;
+                /* the schedule starts once the first handshake is done */
+                if (!c->next_ns) c->next_ns = now + c->offset_ns;
+            }
+            if ((events[i].events & EPOLLOUT) && bconn_flush(c) < 0) {
+                bconn_reset(t, c);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                int r = bconn_read(t, c);
+                if (r > 0)      response_done(t, c, now);
+                else if (r < 0) bconn_reset(t, c);
+            }
+        }
+
+        for (int i = 0; i < t->nconns; i++) maybe_issue(t, &t->conns[i], now);
+    }
+
+    for (int i = 0; i < t->nconns; i++)
+        if (t->conns[i].fd >= 0) close(t->conns[i].fd);
+    close(t->tfd);
+    close(t->ep);
+    return NULL;
+}
+
+/*------------------------------------------------------------
+ *  Report
+ *-----------------------------------------------------------*/
+static void print_latency(const char *label, uint64_t ns)
+{
+    if (ns < 1000000) printf("  %-7s %10.1f us\n", label, (double)ns / 1e3);
+    else              printf("  %-7s %10.2f ms\n", label, (double)ns / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config cfg;
+    parse_arguments(argc, argv, &cfg);
+    scan_init();
+
+    server.sin_family = AF_INET;
+    server.sin_port   = htons((uint16_t)cfg.port);
+    if (inet_pton(AF_INET, cfg.host, &server.sin_addr) != 1) {
+        fprintf(stderr, "invalid IPv4 address '%s'\n", cfg.host);
+        return EXIT_FAILURE;
+    }
+
+    int n = snprintf(request, sizeof(request),
+                     "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: snooze-bench\r\n%s\r\n",
+                     cfg.path, cfg.host, cfg.port, cfg.close ? "Connection: close\r\n" : "");
+    if (n < 0 || (size_t)n >= sizeof(request)) { fprintf(stderr, "path too long\n"); return EXIT_FAILURE; }
+    request_len = (size_t)n;
+
+    struct thread *threads = (struct thread*)calloc((size_t)cfg.threads, sizeof(*threads));
+    struct bconn  *conns   = (struct bconn*)calloc((size_t)cfg.connections, sizeof(*conns));
+    if (!threads || !conns) { perror("calloc"); return EXIT_FAILURE; }
+
+    printf("snooze-bench: %s:%d%s, %d thread%s, %d connection%s, %.1f s, ",
+           cfg.host, cfg.port, cfg.path, cfg.threads, cfg.threads == 1 ? "" : "s",
+           cfg.connections, cfg.connections == 1 ? "" : "s", cfg.duration);
+    if (cfg.rate > 0) printf("open loop at %.0f req/s\n", cfg.rate);
+    else              printf("closed loop\n");
+    fflush(stdout);
+
+    uint64_t start    = now_ns();
+    uint64_t deadline = start + (uint64_t)(cfg.duration * 1e9);
+    for (int i = 0, first = 0; i < cfg.threads; i++) {
+        struct thread *t = &threads[i];
+        int count = cfg.connections / cfg.threads + (i < cfg.connections % cfg.threads);
+        t->cfg         = &cfg;
+        t->conns       = conns + first;
+        t->nconns      = count;
+        t->deadline_ns = deadline;
+        /* each connection carries rate/connections of the load */
+        t->interval_ns = cfg.rate > 0 ? (uint64_t)(1e9 * cfg.connections / cfg.rate) : 0;
+        first += count;
+
+        int err = pthread_create(&t->tid, NULL, thread_main, t);
+        if (err != 0) { fprintf(stderr, "pthread_create: %s\n", strerror(err)); return EXIT_FAILURE; }
+    }
+
+    struct hist *all = (struct hist*)calloc(1, sizeof(*all));
+    if (!all) { perror("calloc"); return EXIT_FAILURE; }
+    uint64_t errors = 0, connects = 0;
+    for (int i = 0; i < cfg.threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        hist_merge(all, &threads[i].hist);
+        errors   += threads[i].errors;
+        connects += threads[i].connects;
+    }
+    double elapsed = (double)(now_ns() - start) / 1e9;
+
+    printf("  requests %10llu  (%llu errors, %llu connects)\n",
+           (unsigned long long)all->total, (unsigned long long)errors,
+           (unsigned long long)connects);
+    printf("  rate     %10.1f req/s\n", (double)all->total / elapsed);
+    if (all->total > 0) {
+        printf("latency%s:\n", cfg.rate > 0 ? " (from scheduled send time)" : "");
+        print_latency("p50",   hist_percentile(all, 50));
+        print_latency("p90",   hist_percentile(all, 90));
+        print_latency("p99",   hist_percentile(all, 99));
+        print_latency("p99.9", hist_percentile(all, 99.9));
+        print_latency("max",   all->max);
+    }
+
+    free(all);
+    free(conns);
+    free(threads);
+    return errors > 0 ? 2 : 0;
+}
@@ -0,0 +1,151 @@
+/*------------------------------------------------------------
+ *  End-of-headers scanner
+ *
+ *  Finds the "\r\n\r\n" that ends an HTTP request head. The
+ *  scan is resumable: callers pass the offset already searched
+ *  so bytes arriving in several recv()s are looked at once, not
+ *  once per read.
+ *
+ *  Vector paths compare four shifted loads against CR LF CR LF
+ *  and AND the results, so every position in a block is tested
+ *  at once:
+ *    x86    SSE2 (16 B) or AVX2 (32 B), chosen at runtime
+ *    arm64  NEON (16 B), always present
+ *  Everything else, and the tail of each buffer, uses the
+ *  scalar loop. Call scan_init() once before the first scan.
+ *-----------------------------------------------------------*/
+#ifndef SNOOZE_SCAN_H
+#define SNOOZE_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define SCAN_X86 1
+#elif defined(__aarch64__)
+#  include <arm_neon.h>
+#  define SCAN_NEON 1
+#endif
+
+typedef size_t (*scan_fn)(const char *buf, size_t from, size_t len);
+
+/*
+ * Returns the index of the first CRLFCRLF at or after `from`, or
+ * len. Inlined into every vector path for its tail, so each one
+ * stays in a single instruction encoding (no AVX/SSE switches).
+ */
+static inline __attribute__((always_inline))
+size_t scan_crlfcrlf_bytes(const char *buf, size_t from, size_t len)
+{
+    for (size_t i = from; i + 3 < len; i++) {
+        if (buf[i] == '\r' && buf[i+1] == '\n' && buf[i+2] == '\r' && buf[i+3] == '\n')
+            return i;
+    }
+    return len;
+}
+
+static size_t scan_crlfcrlf_scalar(const char *buf, size_t from, size_t len)
+{
+    return scan_crlfcrlf_bytes(buf, from, len);
+}
+
+#ifdef SCAN_X86
+/* 16-byte blocks, then bytes; inlined into both x86 entry points */
+static inline __attribute__((always_inline, target("sse2")))
+size_t scan_crlfcrlf_x86_16(const char *buf, size_t i, size_t len)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    for (; i + 3 + 16 <= len; i += 16) {
+        __m128i m = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i)),     cr),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i + 1)), lf)),
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i + 2)), cr),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i + 3)), lf)));
+        unsigned bits = (unsigned)_mm_movemask_epi8(m);
+        if (bits) return i + (size_t)__builtin_ctz(bits);
+    }
+    return scan_crlfcrlf_bytes(buf, i, len);
+}
+
+__attribute__((target("sse2")))
+static size_t scan_crlfcrlf_sse2(const char *buf, size_t from, size_t len)
+{
+    return scan_crlfcrlf_x86_16(buf, from, len);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_crlfcrlf_avx2(const char *buf, size_t from, size_t len)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = from;
+
+    for (; i + 3 + 32 <= len; i += 32) {
+        __m256i m = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i)),     cr),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i + 1)), lf)),
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i + 2)), cr),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i + 3)), lf)));
+        unsigned bits = (unsigned)_mm256_movemask_epi8(m);
+        if (bits) return i + (size_t)__builtin_ctz(bits);
+    }
+    return scan_crlfcrlf_x86_16(buf, i, len);   /* VEX-encoded here */
+}
+#endif
+
+#ifdef SCAN_NEON
+static size_t scan_crlfcrlf_neon(const char *buf, size_t from, size_t len)
+{
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    const uint8x16_t lf = vdupq_n_u8('\n');
+    const uint8_t *p = (const uint8_t*)buf;
+    size_t i = from;
+
+    for (; i + 3 + 16 <= len; i += 16) {
+        uint8x16_t m = vandq_u8(
+            vandq_u8(vceqq_u8(vld1q_u8(p + i),     cr), vceqq_u8(vld1q_u8(p + i + 1), lf)),
+            vandq_u8(vceqq_u8(vld1q_u8(p + i + 2), cr), vceqq_u8(vld1q_u8(p + i + 3), lf)));
+        /* narrow to 4 bits per byte: a 64-bit mask in byte order */
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(
+                            vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (bits) return i + (size_t)(__builtin_ctzll(bits) >> 2);
+    }
+    return scan_crlfcrlf_bytes(buf, i, len);
+}
+#endif
+
+static scan_fn scan_crlfcrlf = scan_crlfcrlf_scalar;
+
+/* Picks the widest scanner the CPU supports; returns its name */
+static const char *scan_init(void)
+{
+#if defined(SCAN_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) { scan_crlfcrlf = scan_crlfcrlf_avx2; return "avx2"; }
+    if (__builtin_cpu_supports("sse2")) { scan_crlfcrlf = scan_crlfcrlf_sse2; return "sse2"; }
+#elif defined(SCAN_NEON)
+    scan_crlfcrlf = scan_crlfcrlf_neon;
+    return "neon";
+#endif
+    return "scalar";
+}
+
+/*
+ * Returns the index just past the CRLFCRLF, or 0 if the head is
+ * not complete yet. *scanned is where the next call resumes; it
+ * stays 3 bytes short of len so a terminator split across reads
+ * is still found. Reset it to 0 for every new request.
+ */
+static size_t find_headers_end(const char *buf, size_t len, size_t *scanned)
+{
+    if (len < 4) return 0;
+    size_t i = scan_crlfcrlf(buf, *scanned, len);
+    if (i + 3 < len) return i + 4;
+    *scanned = len - 3;
+    return 0;
+}
+
+#endif /* SNOOZE_SCAN_H */
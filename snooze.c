@@ -1,17 +1,75 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
+#ifdef SNOOZE_HAVE_ZLIB
+#  include <zlib.h>
+#endif
+#ifdef SNOOZE_HAVE_BROTLI
+#  include <brotli/encode.h>
+#endif
+#ifdef SNOOZE_HAVE_ZSTD
+#  include <zstd.h>
+#endif
+
+#include "scan.h"
+
+#if defined(__linux__) && defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#    include <linux/io_uring.h>
+#    if defined(__NR_io_uring_setup) && defined(IORING_ACCEPT_MULTISHOT)
+#      define SNOOZE_HAVE_IO_URING 1
+#    endif
+#  endif
+#endif
 
 #define DEFAULT_MESSAGE "Hello from snooze!\n"
 #define DEFAULT_PORT    80
+#define MAX_EVENTS      256
+#define DEFAULT_KEEPALIVE_TIMEOUT   5       /* seconds */
+#define DEFAULT_KEEPALIVE_REQUESTS  1000
+#define DEFAULT_HEADER_TIMEOUT      10      /* seconds for a whole request head */
+#define DEFAULT_BODY_TIMEOUT        30      /* seconds without body progress */
+#define DEFAULT_WRITE_TIMEOUT       30      /* seconds without write progress */
+#define DEFAULT_LINGER_TIMEOUT      5       /* seconds draining a closed conn */
+#define LINGER_MAX_BYTES    (1u << 20)      /* drained per closed conn, at most */
+#define DEFAULT_MAX_HEADER_SIZE     8192    /* bytes; larger → 431 */
+#define DEFAULT_LOG_BODY_MAX        8192    /* body bytes kept per dump */
+#define DEFAULT_ACCEPT_BATCH        64      /* accepts per listener wakeup */
+#define MAX_LISTEN      16      /* --listen addresses */
+#define ADDR_NAME_MAX   120     /* format_sockaddr() of any listen address */
+#define OUT_MAX         64      /* iovecs queued per conn (1-2 per response) */
+#define SENDFILE_MIN    16384   /* smaller --message-file bodies are inlined */
+#define CACHE_LINE      64
+#define LOG_RING_SLOTS  4096    /* request dumps in flight (power of two) */
+#define LOG_BATCH       64      /* dumps per writev() */
+#define LOG_SAMPLE_RATIO 10     /* --log-overflow=sample keeps 1 in N */
 
 static volatile int keep_running = 1;
 
@@ -23,10 +81,206 @@ static void handle_signal(int sig) {
     keep_running = 0;
 }
 
+/*------------------------------------------------------------
+ *  Runtime configuration (read-only once the workers start)
+ *-----------------------------------------------------------*/
+enum engine {
+    ENGINE_EPOLL,
+    ENGINE_IO_URING,
+};
+
+enum log_policy {
+    LOG_BLOCK,
+    LOG_DROP,
+    LOG_SAMPLE,
+};
+
+/* One address to listen on (--listen) */
+struct listen_addr {
+    struct sockaddr_storage ss;
+    socklen_t               len;
+    int                     v6only;  /* IPv6 only, no IPv4-mapped peers */
+};
+
+struct config {
+    int         port;
+    struct listen_addr listen[MAX_LISTEN];   /* default: 0.0.0.0:port */
+    int         nlisten;
+    const char *message;
+    const char *message_file;    /* body from a file (NULL: message) */
+    int         workers;     /* event-loop threads, one listener each */
+    int         pin;         /* pin worker i to online CPU i % ncpu   */
+    enum engine engine;
+    int         keepalive_timeout;   /* idle seconds; 0 disables keep-alive */
+    int         keepalive_requests;  /* per connection; 0 means unlimited   */
+    int         header_timeout;      /* seconds to receive a head (0: off)  */
+    int         body_timeout;        /* seconds between body reads (0: off) */
+    int         write_timeout;       /* seconds between writes (0: off)     */
+    int         linger_timeout;      /* seconds draining before close (0: off) */
+    enum log_policy log_overflow;    /* when the dump ring is full          */
+    int         log_sample;          /* dump 1 in N requests (0/1: all)     */
+    int         log_rate;            /* max dumps per second; 0: unlimited  */
+    int         log_headers_only;    /* leave request bodies out of dumps   */
+    size_t      log_body_max;        /* body bytes kept per dump            */
+    size_t      max_header_size;     /* request line + headers; else 431    */
+    size_t      max_body_size;       /* Content-Length; else 413 (0: any)   */
+    const char *metrics_path;        /* scrape path on --port (NULL: off)   */
+    int         metrics_port;        /* admin listener for scrapes (0: off) */
+    int         backlog;             /* listen() queue length               */
+    int         defer_accept;        /* TCP_DEFER_ACCEPT seconds (0: off)   */
+    int         fastopen;            /* TCP_FASTOPEN queue length (0: off)  */
+    int         accept_batch;        /* accepts per listener event (epoll)  */
+};
+
+/*------------------------------------------------------------
+ *  Socket addresses
+ *
+ *  --listen takes PORT or *:PORT (dual-stack: [::] that also
+ *  accepts IPv4, or 0.0.0.0 where IPv6 is unavailable),
+ *  IPV4:PORT, [IPV6]:PORT (IPv6 only), unix:/PATH, or
+ *  unix:@NAME (Linux abstract namespace, no file). Addresses
+ *  are numeric; nothing is resolved.
+ *-----------------------------------------------------------*/
+static int parse_port(const char *s)
+{
+    char *end;
+    long port = strtol(s, &end, 10);
+    return *s && !*end && port > 0 && port <= 65535 ? (int)port : -1;
+}
+
+static int parse_listen(const char *spec, struct listen_addr *la)
+{
+    memset(la, 0, sizeof(*la));
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un*)&la->ss;
+        const char *path = spec + 5;
+        size_t plen = strlen(path);
+        if (plen < 2 || plen >= sizeof(un->sun_path)) return -1;
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, path, plen);
+        if (path[0] == '@') {                  /* abstract: leading NUL, exact length */
+            un->sun_path[0] = '\0';
+            la->len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + plen);
+        } else {
+            la->len = (socklen_t)sizeof(*un);
+        }
+        return 0;
+    }
+
+    const char *colon = strrchr(spec, ':');
+    const char *port_s = colon ? colon + 1 : spec;
+    int port = parse_port(port_s);
+    if (port < 0) return -1;
+
+    char host[INET6_ADDRSTRLEN + 2];
+    size_t hlen = colon ? (size_t)(colon - spec) : 0;
+    if (hlen >= sizeof(host)) return -1;
+    memcpy(host, spec, hlen);
+    host[hlen] = '\0';
+
+    struct sockaddr_in  *in4 = (struct sockaddr_in*)&la->ss;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6*)&la->ss;
+    if (hlen == 0 || strcmp(host, "*") == 0) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_addr   = in6addr_any;
+        in6->sin6_port   = htons((uint16_t)port);
+        la->len = sizeof(*in6);
+    } else if (host[0] == '[' && host[hlen - 1] == ']') {
+        host[hlen - 1] = '\0';
+        if (inet_pton(AF_INET6, host + 1, &in6->sin6_addr) != 1) return -1;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port   = htons((uint16_t)port);
+        la->len    = sizeof(*in6);
+        la->v6only = 1;
+    } else {
+        if (inet_pton(AF_INET, host, &in4->sin_addr) != 1) return -1;
+        in4->sin_family = AF_INET;
+        in4->sin_port   = htons((uint16_t)port);
+        la->len = sizeof(*in4);
+    }
+    return 0;
+}
+
+static int sockaddr_port(const struct sockaddr_storage *ss)
+{
+    if (ss->ss_family == AF_INET)  return ntohs(((const struct sockaddr_in*)ss)->sin_port);
+    if (ss->ss_family == AF_INET6) return ntohs(((const struct sockaddr_in6*)ss)->sin6_port);
+    return 0;
+}
+
+/*
+ * "ip:port", or "[ip6]:port"; IPv4-mapped peers of a dual-stack
+ * listener print as plain IPv4. Unix sockets print as unix:PATH
+ * or unix:@NAME (len bytes of ss are valid), and clients, which
+ * are normally unnamed, as just "unix". Returns buf.
+ */
+static char *format_sockaddr(const struct sockaddr_storage *ss, socklen_t len,
+                             char *buf, size_t size)
+{
+    char ip[INET6_ADDRSTRLEN] = "unknown";
+    int port = sockaddr_port(ss);
+    if (ss->ss_family == AF_UNIX) {
+        const struct sockaddr_un *un = (const struct sockaddr_un*)ss;
+        size_t off = offsetof(struct sockaddr_un, sun_path);
+        int plen = len > off ? (int)(len - off) : 0;
+        if (plen > 0 && un->sun_path[0] == '\0')
+            snprintf(buf, size, "unix:@%.*s", plen - 1, un->sun_path + 1);
+        else if (plen > 0)
+            snprintf(buf, size, "unix:%.*s", plen, un->sun_path);
+        else
+            snprintf(buf, size, "unix");
+        return buf;
+    }
+    if (ss->ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((const struct sockaddr_in*)ss)->sin_addr, ip, sizeof(ip));
+    } else if (ss->ss_family == AF_INET6) {
+        const struct in6_addr *a = &((const struct sockaddr_in6*)ss)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(a)) {
+            inet_ntop(AF_INET, &a->s6_addr[12], ip, sizeof(ip));
+        } else {
+            inet_ntop(AF_INET6, a, ip, sizeof(ip));
+            snprintf(buf, size, "[%s]:%d", ip, port);
+            return buf;
+        }
+    }
+    snprintf(buf, size, "%s:%d", ip, port);
+    return buf;
+}
+
+/* Receive buffer per connection: fixed, never grows */
+static size_t conn_buf_size(const struct config *cfg)
+{
+    return cfg->max_header_size + cfg->log_body_max;
+}
+
 /**
  * Parses command-line arguments of the form:
  *   --port=XXXX
+ *   --listen=[ADDR:]PORT (repeatable)
  *   --message=YYYY
+ *   --message-file=PATH
+ *   --workers=N
+ *   --pin
+ *   --engine=epoll|io_uring
+ *   --keepalive-timeout=SECONDS
+ *   --keepalive-requests=N
+ *   --header-timeout=SECONDS
+ *   --body-timeout=SECONDS
+ *   --write-timeout=SECONDS
+ *   --linger-timeout=SECONDS
+ *   --log-overflow=block|drop|sample
+ *   --log-sample=N
+ *   --log-rate=N
+ *   --log-headers-only
+ *   --log-body-max=BYTES
+ *   --max-header-size=BYTES
+ *   --max-body-size=BYTES
+ *   --metrics-path=PATH
+ *   --metrics-port=PORT
+ *   --backlog=N
+ *   --defer-accept=SECONDS
+ *   --fastopen=N
+ *   --accept-batch=N
  *
  * Precedence order:
  *   1) Environment variables (PORT, MESSAGE) – highest
@@ -35,46 +289,287 @@ static void handle_signal(int sig) {
  *
  * On --help, prints usage and exits.
  */
-static void parse_arguments(int argc, char *argv[],
-                            int *port, const char **message)
+static void parse_arguments(int argc, char *argv[], struct config *cfg)
 {
     int opt, env_p = 0;
     const char *env_message = NULL, *env_port = NULL;
 
     /* 1) Start with defaults */
-    *port    = DEFAULT_PORT;
-    *message = DEFAULT_MESSAGE;
+    cfg->port    = DEFAULT_PORT;
+    cfg->nlisten = 0;
+    cfg->message = DEFAULT_MESSAGE;
+    cfg->message_file = NULL;
+    cfg->workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    cfg->pin     = 0;
+    cfg->engine  = ENGINE_EPOLL;
+    cfg->keepalive_timeout  = DEFAULT_KEEPALIVE_TIMEOUT;
+    cfg->keepalive_requests = DEFAULT_KEEPALIVE_REQUESTS;
+    cfg->header_timeout     = DEFAULT_HEADER_TIMEOUT;
+    cfg->body_timeout       = DEFAULT_BODY_TIMEOUT;
+    cfg->write_timeout      = DEFAULT_WRITE_TIMEOUT;
+    cfg->linger_timeout     = DEFAULT_LINGER_TIMEOUT;
+    cfg->log_overflow       = LOG_BLOCK;
+    cfg->log_sample         = 0;
+    cfg->log_rate           = 0;
+    cfg->log_headers_only   = 0;
+    cfg->log_body_max       = DEFAULT_LOG_BODY_MAX;
+    cfg->max_header_size    = DEFAULT_MAX_HEADER_SIZE;
+    cfg->max_body_size      = 0;
+    cfg->metrics_path       = NULL;
+    cfg->metrics_port       = 0;
+    cfg->backlog            = SOMAXCONN;
+    cfg->defer_accept       = 0;
+    cfg->fastopen           = 0;
+    cfg->accept_batch       = DEFAULT_ACCEPT_BATCH;
+    if (cfg->workers < 1) cfg->workers = 1;
 
     /* 2) Environment overrides */
     env_port = getenv("PORT");
     if (env_port != NULL) {
         env_p = atoi(env_port);
-        if (env_p > 0) *port = env_p;
+        if (env_p > 0) cfg->port = env_p;
     }
     env_message = getenv("MESSAGE");
-    if (env_message != NULL) *message = env_message;
+    if (env_message != NULL) cfg->message = env_message;
 
     /* 3) Command-line flags (only if env var did NOT override) */
     static const struct option long_opts[] = {
         { "message", required_argument, NULL, 'm' },
+        { "message-file", required_argument, NULL, 'F' },
         { "port",    required_argument, NULL, 'p' },
+        { "listen",  required_argument, NULL, 'l' },
+        { "workers", required_argument, NULL, 'w' },
+        { "pin",     no_argument,       NULL, 'P' },
+        { "engine",  required_argument, NULL, 'E' },
+        { "keepalive-timeout",  required_argument, NULL, 'K' },
+        { "keepalive-requests", required_argument, NULL, 'R' },
+        { "header-timeout",     required_argument, NULL, 'Q' },
+        { "body-timeout",       required_argument, NULL, 'U' },
+        { "write-timeout",      required_argument, NULL, 'W' },
+        { "linger-timeout",     required_argument, NULL, 'N' },
+        { "log-overflow",       required_argument, NULL, 'L' },
+        { "log-sample",         required_argument, NULL, 'S' },
+        { "log-rate",           required_argument, NULL, 'T' },
+        { "log-headers-only",   no_argument,       NULL, 'H' },
+        { "log-body-max",       required_argument, NULL, 'B' },
+        { "max-header-size",    required_argument, NULL, 'X' },
+        { "max-body-size",      required_argument, NULL, 'Y' },
+        { "metrics-path",       required_argument, NULL, 'M' },
+        { "metrics-port",       required_argument, NULL, 'A' },
+        { "backlog",            required_argument, NULL, 'G' },
+        { "defer-accept",       required_argument, NULL, 'D' },
+        { "fastopen",           required_argument, NULL, 'O' },
+        { "accept-batch",       required_argument, NULL, 'J' },
         { "help",    no_argument,       NULL, 'h' },
         { NULL, 0, NULL, 0 }
     };
 
-    while ((opt = getopt_long(argc, argv, "m:p:h", long_opts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "m:p:w:h", long_opts, NULL)) != -1) {
         switch (opt) {
             case 'm':
-                if (env_message == NULL) *message = optarg;
+                if (env_message == NULL) cfg->message = optarg;
+                break;
+            case 'F':
+                if (env_message == NULL) cfg->message_file = optarg;
                 break;
             case 'p':
-                if (env_p == 0) *port = atoi(optarg);
+                if (env_p == 0) cfg->port = atoi(optarg);
+                break;
+            case 'l':
+                if (cfg->nlisten == MAX_LISTEN) {
+                    fprintf(stderr, "at most %d --listen addresses\n", MAX_LISTEN);
+                    exit(EXIT_FAILURE);
+                }
+                if (parse_listen(optarg, &cfg->listen[cfg->nlisten]) < 0) {
+                    fprintf(stderr, "invalid --listen '%s' (PORT, *:PORT, IPV4:PORT, [IPV6]:PORT,\n"
+                                    "unix:/PATH or unix:@NAME)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                cfg->nlisten++;
+                break;
+            case 'w':
+                cfg->workers = atoi(optarg);
+                if (cfg->workers < 1) {
+                    fprintf(stderr, "--workers must be at least 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                cfg->pin = 1;
+                break;
+            case 'E':
+                if      (strcmp(optarg, "epoll") == 0)    cfg->engine = ENGINE_EPOLL;
+                else if (strcmp(optarg, "io_uring") == 0) cfg->engine = ENGINE_IO_URING;
+                else {
+                    fprintf(stderr, "unknown engine '%s' (epoll, io_uring)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'K':
+                cfg->keepalive_timeout = atoi(optarg);
+                if (cfg->keepalive_timeout < 0) cfg->keepalive_timeout = 0;
+                break;
+            case 'R':
+                cfg->keepalive_requests = atoi(optarg);
+                if (cfg->keepalive_requests < 0) cfg->keepalive_requests = 0;
+                break;
+            case 'Q':
+                cfg->header_timeout = atoi(optarg);
+                if (cfg->header_timeout < 0) cfg->header_timeout = 0;
+                break;
+            case 'U':
+                cfg->body_timeout = atoi(optarg);
+                if (cfg->body_timeout < 0) cfg->body_timeout = 0;
+                break;
+            case 'W':
+                cfg->write_timeout = atoi(optarg);
+                if (cfg->write_timeout < 0) cfg->write_timeout = 0;
+                break;
+            case 'N':
+                cfg->linger_timeout = atoi(optarg);
+                if (cfg->linger_timeout < 0) cfg->linger_timeout = 0;
+                break;
+            case 'L':
+                if      (strcmp(optarg, "block") == 0)  cfg->log_overflow = LOG_BLOCK;
+                else if (strcmp(optarg, "drop") == 0)   cfg->log_overflow = LOG_DROP;
+                else if (strcmp(optarg, "sample") == 0) cfg->log_overflow = LOG_SAMPLE;
+                else {
+                    fprintf(stderr, "unknown log overflow policy '%s' (block, drop, sample)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                cfg->log_sample = atoi(optarg);
+                break;
+            case 'T':
+                cfg->log_rate = atoi(optarg);
+                break;
+            case 'H':
+                cfg->log_headers_only = 1;
+                break;
+            case 'B':
+                cfg->log_body_max = strtoull(optarg, NULL, 10);
+                break;
+            case 'X':
+                cfg->max_header_size = strtoull(optarg, NULL, 10);
+                if (cfg->max_header_size < 64) {
+                    fprintf(stderr, "--max-header-size must be at least 64\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'Y':
+                cfg->max_body_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'M':
+                if (optarg[0] != '/') {
+                    fprintf(stderr, "--metrics-path must start with '/'\n");
+                    exit(EXIT_FAILURE);
+                }
+                cfg->metrics_path = optarg;
+                break;
+            case 'A':
+                cfg->metrics_port = atoi(optarg);
+                if (cfg->metrics_port <= 0 || cfg->metrics_port > 65535) {
+                    fprintf(stderr, "invalid --metrics-port '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'G':
+                cfg->backlog = atoi(optarg);
+                if (cfg->backlog < 1) {
+                    fprintf(stderr, "--backlog must be at least 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'D':
+                cfg->defer_accept = atoi(optarg);
+                if (cfg->defer_accept < 0) cfg->defer_accept = 0;
+                break;
+            case 'O':
+                cfg->fastopen = atoi(optarg);
+                if (cfg->fastopen < 0) cfg->fastopen = 0;
+                break;
+            case 'J':
+                cfg->accept_batch = atoi(optarg);
+                if (cfg->accept_batch < 1) {
+                    fprintf(stderr, "--accept-batch must be at least 1\n");
+                    exit(EXIT_FAILURE);
+                }
                 break;
             case 'h':
                 printf("Usage: %s [OPTIONS]\n\n", argv[0]);
                 printf("Options:\n");
                 printf("  -m, --message=TEXT  Set the message to send\n");
+                printf("      --message-file=PATH\n"
+                       "                      Send the contents of PATH instead (read once,\n"
+                       "                      large files go out with sendfile)\n");
                 printf("  -p, --port=PORT     Set the port to listen on (default: 80)\n");
+                printf("      --listen=ADDR   Listen on ADDR instead of 0.0.0.0:PORT; repeat\n"
+                       "                      for several. PORT or *:PORT (dual-stack),\n"
+                       "                      IPV4:PORT, [IPV6]:PORT (IPv6 only), unix:/PATH\n"
+                       "                      or unix:@NAME (abstract namespace)\n");
+                printf("  -w, --workers=N     Event-loop threads (default: online CPUs)\n");
+                printf("      --pin           Pin each worker thread to its own CPU\n");
+                printf("      --engine=NAME   I/O engine: epoll (default) or io_uring\n");
+                printf("      --keepalive-timeout=SECONDS\n"
+                       "                      Idle time before a persistent connection is\n"
+                       "                      closed (default: %d, 0 disables keep-alive)\n",
+                       DEFAULT_KEEPALIVE_TIMEOUT);
+                printf("      --keepalive-requests=N\n"
+                       "                      Requests served per connection (default: %d,\n"
+                       "                      0 for unlimited)\n", DEFAULT_KEEPALIVE_REQUESTS);
+                printf("      --header-timeout=SECONDS\n"
+                       "                      Time to receive a whole request head\n"
+                       "                      (default: %d, 0 disables)\n", DEFAULT_HEADER_TIMEOUT);
+                printf("      --body-timeout=SECONDS\n"
+                       "                      Longest wait for more request body (default:\n"
+                       "                      %d, 0 disables)\n", DEFAULT_BODY_TIMEOUT);
+                printf("      --write-timeout=SECONDS\n"
+                       "                      Longest wait for a slow reader to accept more\n"
+                       "                      response (default: %d, 0 disables)\n",
+                       DEFAULT_WRITE_TIMEOUT);
+                printf("      --linger-timeout=SECONDS\n"
+                       "                      After the last response, keep reading (and\n"
+                       "                      discarding) up to %u KiB from the client for\n"
+                       "                      this long before closing, so it does not see\n"
+                       "                      a reset (default: %d, 0 closes at once)\n",
+                       LINGER_MAX_BYTES >> 10, DEFAULT_LINGER_TIMEOUT);
+                printf("      --log-overflow=POLICY\n"
+                       "                      When the request-dump queue is full: block\n"
+                       "                      (default), drop, or sample (keep 1 in %d)\n",
+                       LOG_SAMPLE_RATIO);
+                printf("      --log-sample=N  Dump only 1 in N requests\n");
+                printf("      --log-rate=N    Dump at most N requests per second\n");
+                printf("      --log-headers-only\n"
+                       "                      Leave request bodies out of the dump\n");
+                printf("      --log-body-max=BYTES\n"
+                       "                      Body bytes kept per dump (default: %d); the\n"
+                       "                      rest is discarded without being buffered\n",
+                       DEFAULT_LOG_BODY_MAX);
+                printf("      --max-header-size=BYTES\n"
+                       "                      Largest request head accepted (default: %d);\n"
+                       "                      larger requests get 431\n", DEFAULT_MAX_HEADER_SIZE);
+                printf("      --max-body-size=BYTES\n"
+                       "                      Largest Content-Length accepted (default: no\n"
+                       "                      limit); larger requests get 413\n");
+                printf("      --metrics-path=PATH\n"
+                       "                      Serve Prometheus metrics at PATH (e.g. /metrics)\n"
+                       "                      on the main port\n");
+                printf("      --metrics-port=PORT\n"
+                       "                      Serve Prometheus metrics on a separate port\n"
+                       "                      (any path; scrapes are not dumped)\n");
+                printf("      --backlog=N     Accept queue length per listener (default:\n"
+                       "                      SOMAXCONN = %d; net.core.somaxconn caps it)\n",
+                       SOMAXCONN);
+                printf("      --defer-accept=SECONDS\n"
+                       "                      Wake the server only once a request arrives\n"
+                       "                      (TCP_DEFER_ACCEPT; default: off)\n");
+                printf("      --fastopen=N    Accept TCP Fast Open data, N pending at most\n"
+                       "                      (default: off)\n");
+                printf("      --accept-batch=N\n"
+                       "                      Connections accepted per listener wakeup before\n"
+                       "                      serving other sockets again (default: %d)\n",
+                       DEFAULT_ACCEPT_BATCH);
                 printf("  -h, --help          Show this help message\n");
                 exit(EXIT_SUCCESS);
             default:
@@ -82,158 +577,567 @@ static void parse_arguments(int argc, char *argv[],
                 exit(EXIT_FAILURE);
         }
     }
+
+    if (cfg->nlisten == 0) {                   /* the classic 0.0.0.0:PORT */
+        struct sockaddr_in *in4 = (struct sockaddr_in*)&cfg->listen[0].ss;
+        memset(&cfg->listen[0], 0, sizeof(cfg->listen[0]));
+        in4->sin_family      = AF_INET;
+        in4->sin_port        = htons((uint16_t)cfg->port);
+        in4->sin_addr.s_addr = htonl(INADDR_ANY);
+        cfg->listen[0].len   = sizeof(*in4);
+        cfg->nlisten = 1;
+    }
+    for (int i = 0; i < cfg->nlisten; i++) {
+        if (cfg->metrics_port > 0 && cfg->metrics_port == sockaddr_port(&cfg->listen[i].ss)) {
+            fprintf(stderr, "--metrics-port must differ from the main port\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 }
 
 /*------------------------------------------------------------
  *  Helpers to read full HTTP request once and log it in ONE
- *  contiguous block. Logging is enabled by default; no limits.
+ *  contiguous block. Logging is enabled by default; the head
+ *  and the logged body are bounded by --max-header-size and
+ *  --log-body-max.
  *
- *  Strategy:
- *    1) Read until "\r\n\r\n" (end of headers), blocking.
- *    2) If Content-Length is present, read exactly that many
- *       body bytes (blocking). Otherwise, log only the headers
+ *  Strategy (driven by the event loop, never blocking):
+ *    1) Buffer input until "\r\n\r\n" (end of headers; see
+ *       scan.h, which only looks at newly arrived bytes).
+ *    2) If Content-Length is present, keep buffering until that
+ *       many body bytes arrived. Otherwise, log only the headers
  *       and any extra bytes already received.
  *    3) Print a single dump framed by "=== snooze request dump".
  *-----------------------------------------------------------*/
-static size_t find_headers_end(const char *buf, size_t len) {
-    if (len < 4) return (size_t)0;
-    for (size_t i = 0; i + 3 < len; i++) {
-        if (buf[i] == '\r' && buf[i+1] == '\n' && buf[i+2] == '\r' && buf[i+3] == '\n')
-            return i + 4; /* index just past the CRLF CRLF */
+/*
+ * Request head index. Once the head is complete it is walked
+ * exactly once and every part of it is recorded as an offset/
+ * length slice into the receive buffer: nothing is copied or
+ * allocated. Headers the server acts on are also indexed by id,
+ * so looking them up is O(1) instead of a rescan of the buffer.
+ */
+#define HTTP_MAX_HEADERS 64
+
+struct slice {
+    uint32_t off, len;
+};
+
+enum hdr_id {                    /* headers looked up by id */
+    HDR_ACCEPT_ENCODING,
+    HDR_CONNECTION,
+    HDR_CONTENT_LENGTH,
+    HDR_HOST,
+    HDR_IF_NONE_MATCH,
+    HDR_TRANSFER_ENCODING,
+    HDR_KNOWN
+};
+
+static const char *const hdr_names[HDR_KNOWN] = {
+    [HDR_ACCEPT_ENCODING]   = "Accept-Encoding",
+    [HDR_CONNECTION]        = "Connection",
+    [HDR_CONTENT_LENGTH]    = "Content-Length",
+    [HDR_HOST]              = "Host",
+    [HDR_IF_NONE_MATCH]     = "If-None-Match",
+    [HDR_TRANSFER_ENCODING] = "Transfer-Encoding",
+};
+
+struct http_req {
+    struct slice method, path, version;
+    int          http11;                  /* version is HTTP/1.1      */
+    int          nhdr;
+    struct slice name[HTTP_MAX_HEADERS];
+    struct slice value[HTTP_MAX_HEADERS]; /* blanks trimmed           */
+    int8_t       known[HDR_KNOWN];        /* index into value[], or -1 */
+};
+
+static enum hdr_id hdr_lookup_id(const char *name, size_t len)
+{
+    for (int id = 0; id < HDR_KNOWN; id++) {
+        if (strlen(hdr_names[id]) == len && strncasecmp(name, hdr_names[id], len) == 0)
+            return (enum hdr_id)id;
     }
-    return (size_t)0;
+    return HDR_KNOWN;
 }
 
-static size_t parse_content_length(const char *hdrs, size_t hdr_len) {
-    /* simple, case-insensitive scan for "Content-Length:" */
-    const char *p = hdrs;
-    const char *end = hdrs + hdr_len;
-    while (p < end) {
-        const char *eol = memchr(p, '\n', (size_t)(end - p));
-        if (!eol) eol = end;
-        if ((size_t)(eol - p) >= 15 && strncasecmp(p, "Content-Length:", 15) == 0) {
-            const char *v = p + 15;
-            while (v < eol && (*v == ' ' || *v == '\t')) v++;
-            return (size_t)strtoull(v, NULL, 10);
+/*
+ * Indexes the head req[0, hdr_end). Returns 0 on success, -1 if
+ * it is malformed and -2 if it has more than HTTP_MAX_HEADERS.
+ */
+static int http_parse(struct http_req *h, const char *req, size_t hdr_end)
+{
+    const char *p = req, *end = req + hdr_end;
+
+    memset(h->known, -1, sizeof(h->known));
+    h->nhdr = 0;
+
+    /* request line: METHOD SP TARGET SP VERSION */
+    const char *eol = memchr(p, '\n', (size_t)(end - p));
+    const char *le  = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+    const char *sp1 = memchr(p, ' ', (size_t)(le - p));
+    const char *sp2 = sp1 ? memchr(sp1 + 1, ' ', (size_t)(le - sp1 - 1)) : NULL;
+    if (!sp2 || sp1 == p || sp2 == sp1 + 1) return -1;
+    if (le - sp2 - 1 != 8 || memcmp(sp2 + 1, "HTTP/1.", 7) != 0) return -1;
+
+    h->method  = (struct slice){ 0, (uint32_t)(sp1 - p) };
+    h->path    = (struct slice){ (uint32_t)(sp1 + 1 - req), (uint32_t)(sp2 - sp1 - 1) };
+    h->version = (struct slice){ (uint32_t)(sp2 + 1 - req), 8 };
+    h->http11  = sp2[8] == '1';
+
+    /* header lines up to the empty one */
+    for (p = eol + 1; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', (size_t)(end - p));
+        le  = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+        if (le == p) break;                             /* end of head */
+        if (*p == ' ' || *p == '\t') return -1;         /* obsolete folding */
+
+        const char *colon = memchr(p, ':', (size_t)(le - p));
+        if (!colon || colon == p) return -1;
+        if (h->nhdr == HTTP_MAX_HEADERS) return -2;
+
+        const char *v = colon + 1, *ve = le;
+        while (v < ve && (*v == ' ' || *v == '\t')) v++;
+        while (ve > v && (ve[-1] == ' ' || ve[-1] == '\t')) ve--;
+
+        int i = h->nhdr++;
+        h->name[i]  = (struct slice){ (uint32_t)(p - req), (uint32_t)(colon - p) };
+        h->value[i] = (struct slice){ (uint32_t)(v - req), (uint32_t)(ve - v) };
+
+        enum hdr_id id = hdr_lookup_id(p, (size_t)(colon - p));
+        if (id == HDR_KNOWN) continue;
+        if (h->known[id] < 0) {
+            h->known[id] = (int8_t)i;
+        } else if (id == HDR_CONTENT_LENGTH) {          /* conflicting framing */
+            struct slice prev = h->value[h->known[id]];
+            if (prev.len != h->value[i].len ||
+                memcmp(req + prev.off, v, prev.len) != 0) return -1;
         }
-        p = (eol < end) ? eol + 1 : end;
     }
     return 0;
 }
 
-static int recv_fully(int fd, char *buf, size_t want) {
-    size_t got = 0;
-    while (got < want) {
-        ssize_t n = recv(fd, buf + got, want - got, 0);
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            return -1;
-        }
-        if (n == 0) return -1; /* peer closed early */
-        got += (size_t)n;
+/* Value of an indexed header, or NULL if the request has none */
+static const char *http_header(const struct http_req *h, const char *req,
+                               enum hdr_id id, size_t *vlen)
+{
+    if (h->known[id] < 0) return NULL;
+    struct slice v = h->value[h->known[id]];
+    *vlen = v.len;
+    return req + v.off;
+}
+
+/*
+ * Content-Length as a plain run of digits. Returns 0 if absent,
+ * -1 if malformed and -2 if it does not fit in a size_t.
+ */
+static int parse_content_length(const struct http_req *h, const char *req, size_t *out) {
+    size_t vlen;
+    const char *v = http_header(h, req, HDR_CONTENT_LENGTH, &vlen);
+    *out = 0;
+    if (!v) return 0;
+    if (vlen == 0) return -1;
+
+    size_t n = 0;
+    for (size_t i = 0; i < vlen; i++) {
+        if (v[i] < '0' || v[i] > '9') return -1;
+        if (n > (SIZE_MAX - (size_t)(v[i] - '0')) / 10) return -2;
+        n = n * 10 + (size_t)(v[i] - '0');
+    }
+    *out = n;
+    return 0;
+}
+
+/* Does a comma-separated header value contain `token`? */
+static int header_has_token(const char *v, size_t vlen, const char *token)
+{
+    const size_t tlen = strlen(token);
+    const char *end = v + vlen;
+    while (v < end) {
+        while (v < end && (*v == ' ' || *v == '\t' || *v == ',')) v++;
+        const char *t = v;
+        while (v < end && *v != ',') v++;
+        const char *te = v;
+        while (te > t && (te[-1] == ' ' || te[-1] == '\t')) te--;
+        if ((size_t)(te - t) == tlen && strncasecmp(t, token, tlen) == 0) return 1;
     }
     return 0;
 }
 
-static void log_full_request_blocking(int sock)
+/*
+ * HTTP/1.1 connections persist unless the client says "close";
+ * HTTP/1.0 ones only with an explicit "keep-alive". Bodies we
+ * cannot frame (Transfer-Encoding) always end the connection.
+ */
+static int wants_keep_alive(const struct http_req *h, const char *req)
+{
+    size_t vlen;
+    if (http_header(h, req, HDR_TRANSFER_ENCODING, &vlen)) return 0;
+
+    const char *v = http_header(h, req, HDR_CONNECTION, &vlen);
+    if (v && header_has_token(v, vlen, "close")) return 0;
+    if (h->http11) return 1;
+    return v && header_has_token(v, vlen, "keep-alive");
+}
+
+/*
+ * Content codings, in the order we prefer them when a client
+ * accepts several with the same weight.
+ */
+enum encoding {
+    ENC_IDENTITY,
+    ENC_GZIP,
+    ENC_ZSTD,
+    ENC_BR,
+    ENC_COUNT
+};
+
+static const char *const enc_names[ENC_COUNT] = {
+    [ENC_IDENTITY] = "identity",
+    [ENC_GZIP]     = "gzip",
+    [ENC_ZSTD]     = "zstd",
+    [ENC_BR]       = "br",
+};
+
+/* A qvalue ("0", "0.5", "1.000") in thousandths; -1 if malformed */
+static int parse_qvalue(const char *v, size_t len)
+{
+    if (len == 0 || (v[0] != '0' && v[0] != '1')) return -1;
+    int q = (v[0] - '0') * 1000, scale = 100;
+    if (len > 1 && v[1] != '.') return -1;
+    for (size_t i = 2; i < len && i < 5; i++, scale /= 10) {
+        if (v[i] < '0' || v[i] > '9') return -1;
+        q += (v[i] - '0') * scale;
+    }
+    return q > 1000 ? -1 : q;
+}
+
+/*
+ * Weights from an Accept-Encoding value, for every coding we know
+ * (q[] in thousandths; 0 means refused). Codings not listed take
+ * the weight of "*" if present; identity stays acceptable unless
+ * refused explicitly.
+ */
+static void accept_encoding_weights(const char *v, size_t vlen, int q[ENC_COUNT])
+{
+    int star = -1;
+    for (int e = 0; e < ENC_COUNT; e++) q[e] = -1;
+
+    const char *end = v + vlen;
+    while (v < end) {
+        while (v < end && (*v == ' ' || *v == '\t' || *v == ',')) v++;
+        const char *t = v;
+        while (v < end && *v != ',' && *v != ';' && *v != ' ' && *v != '\t') v++;
+        size_t tlen = (size_t)(v - t);
+
+        int weight = 1000;
+        while (v < end && *v != ',') {             /* parameters: only q */
+            while (v < end && (*v == ' ' || *v == '\t' || *v == ';')) v++;
+            const char *p = v;
+            while (v < end && *v != ',' && *v != ';') v++;
+            const char *pe = v;
+            while (pe > p && (pe[-1] == ' ' || pe[-1] == '\t')) pe--;
+            if (pe - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+                int w = parse_qvalue(p + 2, (size_t)(pe - p - 2));
+                weight = w < 0 ? 0 : w;
+            }
+        }
+
+        if (tlen == 1 && *t == '*') { star = weight; continue; }
+        for (int e = 0; e < ENC_COUNT; e++) {
+            if (strlen(enc_names[e]) == tlen && strncasecmp(t, enc_names[e], tlen) == 0)
+                q[e] = weight;
+        }
+        if (tlen == 6 && strncasecmp(t, "x-gzip", 6) == 0) q[ENC_GZIP] = weight;
+    }
+
+    for (int e = 0; e < ENC_COUNT; e++)
+        if (q[e] < 0) q[e] = star >= 0 ? star : (e == ENC_IDENTITY ? 1 : 0);
+}
+
+/*
+ * Does an If-None-Match list name `etag` (quoted)? Uses the weak
+ * comparison the header calls for, so W/"x" matches "x"; "*"
+ * matches anything.
+ */
+static int etag_matches(const char *v, size_t vlen, const char *etag)
 {
-    /* Step 0: capture peer info for banner */
-    struct sockaddr_in peer;
-    socklen_t plen = sizeof(peer);
-    char ip[INET_ADDRSTRLEN] = "unknown";
-    int  port = 0;
-    if (getpeername(sock, (struct sockaddr*)&peer, &plen) == 0) {
-        inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
-        port = ntohs(peer.sin_port);
+    const size_t elen = strlen(etag);
+    const char *end = v + vlen;
+    while (v < end) {
+        while (v < end && (*v == ' ' || *v == '\t' || *v == ',')) v++;
+        if (v < end && *v == '*') return 1;
+        if (end - v >= 2 && v[0] == 'W' && v[1] == '/') v += 2;
+        const char *t = v;
+        if (v < end && *v == '"') {
+            v++;
+            while (v < end && *v != '"') v++;
+            if (v < end) v++;
+        }
+        if ((size_t)(v - t) == elen && memcmp(t, etag, elen) == 0) return 1;
+        while (v < end && *v != ',') v++;
     }
+    return 0;
+}
+
+/*------------------------------------------------------------
+ *  Asynchronous request-dump logger
+ *
+ *  Workers never touch stderr. Each dump is rendered into one
+ *  heap block and pushed into a bounded lock-free MPSC ring
+ *  (Vyukov-style sequence numbers per slot); a dedicated writer
+ *  thread pops blocks in batches and emits them with writev(),
+ *  so a slow log pipe no longer throttles request handling.
+ *
+ *  When the ring is full the --log-overflow policy decides:
+ *    block  – wait for the writer (every dump is kept; default)
+ *    drop   – discard the dump and count it
+ *    sample – above half full keep 1 in LOG_SAMPLE_RATIO dumps,
+ *             drop when full
+ *  Dropped dumps are reported inline in the log stream.
+ *-----------------------------------------------------------*/
+struct log_slot {
+    atomic_size_t seq;
+    char         *data;
+    size_t        len;
+};
 
-    /* Step 1: read until end of headers */
-    size_t cap = 8192;                         /* grows as needed */
-    size_t len = 0;
-    char *req = (char*)malloc(cap);
-    if (!req) return;
+static struct {
+    struct log_slot *slots;
+    size_t           mask;
+    enum log_policy  policy;
+
+    _Alignas(CACHE_LINE) atomic_size_t enq;      /* producers          */
+    _Alignas(CACHE_LINE) atomic_size_t deq;      /* writer thread only */
+    _Alignas(CACHE_LINE) atomic_int    writer_idle;
+    atomic_int    stop;
+    atomic_size_t dropped;
+    atomic_size_t sample_tick;
+    int           wake_fd;                       /* eventfd            */
+    pthread_t     tid;
+} logq;
+
+static size_t log_ring_used(void)
+{
+    return atomic_load_explicit(&logq.enq, memory_order_relaxed) -
+           atomic_load_explicit(&logq.deq, memory_order_relaxed);
+}
 
-    size_t hdr_end = 0;
+/* Returns 0 on success, -1 when the ring is full */
+static int log_try_push(char *data, size_t len)
+{
+    size_t pos = atomic_load_explicit(&logq.enq, memory_order_relaxed);
+    struct log_slot *slot;
     for (;;) {
-        if (len == cap) {                      /* grow buffer */
-            cap *= 2;
-            char *tmp = (char*)realloc(req, cap);
-            if (!tmp) { free(req); return; }
-            req = tmp;
+        slot = &logq.slots[pos & logq.mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&logq.enq, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1;                         /* full */
+        } else {
+            pos = atomic_load_explicit(&logq.enq, memory_order_relaxed);
+        }
+    }
+    slot->data = data;
+    slot->len  = len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+static void log_wake_writer(void)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&logq.writer_idle, 0)) {
+        uint64_t one = 1;
+        ssize_t r = write(logq.wake_fd, &one, sizeof(one));
+        (void)r;                               /* eventfd write cannot block */
+    }
+}
+
+static void log_push(char *data, size_t len)
+{
+    if (logq.policy == LOG_SAMPLE && log_ring_used() > logq.mask / 2 &&
+        atomic_fetch_add_explicit(&logq.sample_tick, 1, memory_order_relaxed)
+            % LOG_SAMPLE_RATIO != 0) {
+        atomic_fetch_add_explicit(&logq.dropped, 1, memory_order_relaxed);
+        free(data);
+        return;
+    }
+
+    while (log_try_push(data, len) < 0) {
+        if (logq.policy != LOG_BLOCK) {
+            atomic_fetch_add_explicit(&logq.dropped, 1, memory_order_relaxed);
+            free(data);
+            return;
         }
-        ssize_t n = recv(sock, req + len, cap - len, 0);
+        log_wake_writer();
+        sched_yield();                         /* block: let the writer catch up */
+    }
+    log_wake_writer();
+}
+
+/* Pops up to `max` dumps; the writer thread is the only consumer */
+static int log_pop_batch(struct iovec *iov, int max)
+{
+    size_t deq = atomic_load_explicit(&logq.deq, memory_order_relaxed);
+    int n = 0;
+    while (n < max) {
+        struct log_slot *slot = &logq.slots[deq & logq.mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != deq + 1) break;             /* empty */
+        iov[n].iov_base = slot->data;
+        iov[n].iov_len  = slot->len;
+        n++;
+        atomic_store_explicit(&slot->seq, deq + logq.mask + 1, memory_order_release);
+        deq++;
+    }
+    atomic_store_explicit(&logq.deq, deq, memory_order_relaxed);
+    return n;
+}
+
+static void write_fully(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
         if (n < 0) {
             if (errno == EINTR) continue;
-            free(req);
-            return;
+            return;                            /* log sink gone: nothing to do */
         }
-        if (n == 0) break;                     /* peer closed */
-        len += (size_t)n;
-        hdr_end = find_headers_end(req, len);
-        if (hdr_end) break;                    /* have full headers */
-    }
-
-    /* Step 2: if Content-Length present, read the rest of the body exactly */
-    size_t body_len = 0;
-    size_t already_body = 0;
-    if (hdr_end) {
-        body_len = parse_content_length(req, hdr_end);
-        already_body = len > hdr_end ? (len - hdr_end) : 0;
-
-        if (body_len > already_body) {
-            size_t need = body_len - already_body;
-            /* ensure capacity */
-            if (len + need > cap) {
-                size_t new_cap = cap;
-                while (len + need > new_cap) new_cap *= 2;
-                char *tmp = (char*)realloc(req, new_cap);
-                if (!tmp) { free(req); return; }
-                req = tmp; cap = new_cap;
-            }
-            if (recv_fully(sock, req + len, need) == -1) {
-                /* couldn't complete body; log whatever we have */
-                need = 0;
+        size_t done = (size_t)n;
+        while (cnt > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++; cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+static void *log_writer_main(void *arg)
+{
+    (void)arg;
+    struct iovec iov[LOG_BATCH + 1];
+    void        *owned[LOG_BATCH];
+    size_t       reported = 0;
+    char         note[96];
+
+    for (;;) {
+        int n = log_pop_batch(iov, LOG_BATCH);
+        if (n > 0) {
+            int popped = n;
+            for (int i = 0; i < popped; i++) owned[i] = iov[i].iov_base;
+
+            size_t dropped = atomic_load_explicit(&logq.dropped, memory_order_relaxed);
+            if (dropped != reported) {
+                int len = snprintf(note, sizeof(note),
+                                   "=== snooze dropped %zu request dumps (log ring full) ===\n",
+                                   dropped - reported);
+                iov[n].iov_base = note;
+                iov[n].iov_len  = (size_t)len;
+                n++;
+                reported = dropped;
             }
-            len += need;
+
+            write_fully(STDERR_FILENO, iov, n);
+            for (int i = 0; i < popped; i++) free(owned[i]);
+            continue;
+        }
+
+        if (atomic_load(&logq.stop)) break;
+
+        /* Nothing queued: announce we sleep, re-check, then block */
+        atomic_store(&logq.writer_idle, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        size_t deq = atomic_load_explicit(&logq.deq, memory_order_relaxed);
+        struct log_slot *slot = &logq.slots[deq & logq.mask];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) == deq + 1 ||
+            atomic_load(&logq.stop)) {
+            atomic_store(&logq.writer_idle, 0);
+            continue;
         }
+        uint64_t v;
+        if (read(logq.wake_fd, &v, sizeof(v)) < 0 && errno != EINTR) break;
     }
+    return NULL;
+}
+
+static int log_start(enum log_policy policy)
+{
+    logq.slots = (struct log_slot*)calloc(LOG_RING_SLOTS, sizeof(*logq.slots));
+    if (!logq.slots) { perror("calloc"); return -1; }
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++)
+        atomic_init(&logq.slots[i].seq, i);
+    logq.mask   = LOG_RING_SLOTS - 1;
+    logq.policy = policy;
 
-    /* Step 3: single clean dump */
-    fprintf(stderr, "=== snooze request dump from %s:%d ===\n", ip, port);
-    (void)fwrite(req, 1, len, stderr);
-    if (len == 0) fputc('\n', stderr);  /* ensure a blank line block if nothing */
-    fprintf(stderr, "=== end request dump ===\n");
-    fflush(stderr);
+    logq.wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (logq.wake_fd < 0) { perror("eventfd"); return -1; }
 
-    free(req);
+    int err = pthread_create(&logq.tid, NULL, log_writer_main, NULL);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
 }
 
-/*------------------------------------------------------------
- *  Robust send() helper
- *     – loops until every byte is written or an error occurs
- *-----------------------------------------------------------*/
-static int send_all(int sock, const char *buf, size_t len)
+/* Flushes everything still queued; call after the workers stopped */
+static void log_stop(void)
 {
-    size_t sent = 0;
-    while (sent < len) {
-        ssize_t n = send(sock, buf + sent, len - sent, MSG_NOSIGNAL);
-        if (n < 0) {
-            if (errno == EINTR)                /* interrupted → retry   */
-                continue;
-            return -1;                         /* hard error            */
-        }
-        if (n == 0)                            /* peer closed early     */
-            return -1;
-        sent += (size_t)n;
+    atomic_store(&logq.stop, 1);
+    uint64_t one = 1;
+    if (write(logq.wake_fd, &one, sizeof(one)) < 0) perror("write");
+    pthread_join(logq.tid, NULL);
+    close(logq.wake_fd);
+    free(logq.slots);
+
+    size_t dropped = atomic_load(&logq.dropped);
+    if (dropped > 0)
+        fprintf(stderr, "snooze dropped %zu request dumps (log ring full)\n", dropped);
+}
+
+static void log_request_dump(const char *peer, const char *req, size_t len, size_t omitted)
+{
+    /* single clean dump, rendered into one block for the writer */
+    static const char footer[] = "=== end request dump ===\n";
+    char banner[128];
+    int blen = snprintf(banner, sizeof(banner),
+                        "=== snooze request dump from %s ===\n", peer);
+    if (blen < 0) return;
+
+    char note[64];
+    int nlen = 0;
+    if (omitted > 0) {                      /* body past --log-body-max */
+        nlen = snprintf(note, sizeof(note), "\n=== %zu body bytes not logged ===\n", omitted);
+        if (nlen < 0) nlen = 0;
     }
-    return 0;                                  /* success               */
+
+    size_t total = (size_t)blen + len + (len == 0) + (size_t)nlen + sizeof(footer) - 1;
+    char *block = (char*)malloc(total);
+    if (!block) return;
+
+    char *p = block;
+    memcpy(p, banner, (size_t)blen);        p += blen;
+    memcpy(p, req, len);                    p += len;
+    if (len == 0) *p++ = '\n';              /* ensure a blank line block if nothing */
+    memcpy(p, note, (size_t)nlen);          p += nlen;
+    memcpy(p, footer, sizeof(footer) - 1);
+
+    log_push(block, total);
 }
 
 /*------------------------------------------------------------
  *  graceful_close()
  *
  *  Half-close for write, drain unread data quietly (no logging),
- *  then close. Avoids TCP RST/ERR_CONTENT_LENGTH_MISMATCH.
+ *  then close. Avoids TCP RST/ERR_CONTENT_LENGTH_MISMATCH for
+ *  data already queued; the event loops linger first (see
+ *  conn_linger()) so data still in flight is drained too.
  *-----------------------------------------------------------*/
 static void graceful_close(int sock)
 {
@@ -252,101 +1156,2416 @@ static void graceful_close(int sock)
     close(sock);
 }
 
-/**
- * Minimal HTTP response helper
+/*------------------------------------------------------------
+ *  Metrics (--metrics-path / --metrics-port)
+ *
+ *  Every worker counts into its own cache-line-aligned block,
+ *  so the hot path is a plain load/add/store on memory no other
+ *  core writes; relaxed atomics only keep the scrape's reads
+ *  well defined. A scrape sums all blocks, giving totals that
+ *  are current but not one consistent snapshot.
+ *
+ *  Request latency (first byte read → response written) goes
+ *  into an HDR-style log-linear histogram of microseconds:
+ *  exact below 8 us, then four buckets per power of two.
+ *-----------------------------------------------------------*/
+enum metric_code {
+    CODE_200,
+    CODE_304,
+    CODE_400,
+    CODE_413,
+    CODE_431,
+    CODE_COUNT
+};
+
+static const char *const code_names[CODE_COUNT] = { "200", "304", "400", "413", "431" };
+
+/* What a connection is waiting for; each phase has its own deadline */
+enum conn_phase {
+    PHASE_NONE,
+    PHASE_HEADERS,               /* the rest of a request head     */
+    PHASE_BODY,                  /* body bytes (kept or discarded) */
+    PHASE_WRITE,                 /* the peer to read our response  */
+    PHASE_IDLE,                  /* a keep-alive follow-up request */
+    PHASE_LINGER,                /* the peer's EOF after our last  */
+    PHASE_COUNT
+};
+
+static const char *const phase_names[PHASE_COUNT] = {
+    "none", "headers", "body", "write", "idle", "linger"
+};
+
+#define LAT_SUB_BITS 2
+#define LAT_SUB      (1u << LAT_SUB_BITS)
+#define LAT_BUCKETS  (2 * LAT_SUB + 22 * LAT_SUB)   /* last: ≥ ~29 s, +Inf only */
+
+struct metrics {
+    _Alignas(CACHE_LINE) atomic_ullong requests[CODE_COUNT];
+    atomic_ullong accepted, closed;
+    atomic_ullong bytes_in, bytes_out;
+    atomic_ullong latency[LAT_BUCKETS];
+    atomic_ullong latency_sum_us;
+    atomic_ullong timeouts[PHASE_COUNT];
+};
+
+static struct metrics *metrics;      /* one block per worker thread */
+static int             metrics_count;
+
+/* Single writer per block: no locked read-modify-write needed */
+static inline void metric_add(atomic_ullong *m, unsigned long long n)
+{
+    atomic_store_explicit(m, atomic_load_explicit(m, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static unsigned lat_index(uint64_t us)
+{
+    if (us < 2 * LAT_SUB) return (unsigned)us;
+    unsigned shift = (unsigned)(63 - __builtin_clzll(us)) - LAT_SUB_BITS;
+    unsigned i = 2 * LAT_SUB + (shift - 1) * LAT_SUB + (unsigned)(us >> shift) - LAT_SUB;
+    return i < LAT_BUCKETS ? i : LAT_BUCKETS - 1;
+}
+
+/* Smallest value (us) that lands in bucket i */
+static uint64_t lat_lower(unsigned i)
+{
+    if (i < 2 * LAT_SUB) return i;
+    unsigned shift = (i - 2 * LAT_SUB) / LAT_SUB + 1;
+    return (uint64_t)(LAT_SUB + (i - 2 * LAT_SUB) % LAT_SUB) << shift;
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * Reads TcpExt ListenOverflows / ListenDrops from /proc/net/netstat:
+ * SYNs refused because an accept queue was full. The counters
+ * cover the whole network namespace (every listener, not just
+ * snooze's). Returns -1 if they are unavailable.
  */
-void send_http_response(int client_sock, const char *message)
+static int read_listen_overflows(unsigned long long *overflows, unsigned long long *drops)
 {
-    const size_t body_len = strlen(message);
+    FILE *f = fopen("/proc/net/netstat", "re");
+    if (!f) return -1;
 
-    char header[256];
-    int hdr_len = snprintf(header, sizeof(header),
-        "HTTP/1.1 200 OK\r\n"
-        "Server: snooze\r\n"
-        "Content-Type: text/html; charset=utf-8\r\n"
-        "Content-Length: %zu\r\n"
-        "Connection: close\r\n"
-        "\r\n",
-        body_len);
+    char names[4096], values[4096];
+    int found = -1;
+    while (fgets(names, sizeof(names), f) && fgets(values, sizeof(values), f)) {
+        if (strncmp(names, "TcpExt:", 7) != 0) continue;
 
-    if (hdr_len < 0 || (size_t)hdr_len >= sizeof(header)) {
-        fprintf(stderr, "header buffer too small\n");
-        graceful_close(client_sock);
-        return;
+        /* the header line names the columns of the line below it */
+        char *nsave, *vsave;
+        char *n = strtok_r(names + 7, " \n", &nsave);
+        char *v = strtok_r(values + 7, " \n", &vsave);
+        *overflows = *drops = 0;
+        for (; n && v; n = strtok_r(NULL, " \n", &nsave), v = strtok_r(NULL, " \n", &vsave)) {
+            if (strcmp(n, "ListenOverflows") == 0) { *overflows = strtoull(v, NULL, 10); found = 0; }
+            else if (strcmp(n, "ListenDrops") == 0) *drops = strtoull(v, NULL, 10);
+        }
+        break;
     }
+    fclose(f);
+    return found;
+}
 
-    if (send_all(client_sock, header, (size_t)hdr_len) == -1 ||
-        send_all(client_sock, message, body_len)        == -1) {
-        graceful_close(client_sock);
-        return;
+/* Prometheus text format, summed over every worker; malloc'd */
+static char *metrics_render(size_t *len)
+{
+    unsigned long long req[CODE_COUNT] = {0}, lat[LAT_BUCKETS] = {0}, tmo[PHASE_COUNT] = {0};
+    unsigned long long accepted = 0, closed = 0, in = 0, out = 0, sum_us = 0;
+
+    for (int w = 0; w < metrics_count; w++) {
+        struct metrics *m = &metrics[w];
+        for (int i = 0; i < CODE_COUNT; i++)
+            req[i] += atomic_load_explicit(&m->requests[i], memory_order_relaxed);
+        for (int i = 0; i < (int)LAT_BUCKETS; i++)
+            lat[i] += atomic_load_explicit(&m->latency[i], memory_order_relaxed);
+        for (int i = 0; i < PHASE_COUNT; i++)
+            tmo[i] += atomic_load_explicit(&m->timeouts[i], memory_order_relaxed);
+        accepted += atomic_load_explicit(&m->accepted, memory_order_relaxed);
+        closed   += atomic_load_explicit(&m->closed, memory_order_relaxed);
+        in       += atomic_load_explicit(&m->bytes_in, memory_order_relaxed);
+        out      += atomic_load_explicit(&m->bytes_out, memory_order_relaxed);
+        sum_us   += atomic_load_explicit(&m->latency_sum_us, memory_order_relaxed);
     }
 
-    graceful_close(client_sock);
-}
+    char *buf = NULL;
+    FILE *f = open_memstream(&buf, len);
+    if (!f) return NULL;
 
-/*------------------------------------------------------------
- *  Main server loop
- *-----------------------------------------------------------*/
-int main(int argc, char *argv[])
-{
-    int port, ret;
-    const char *message;
+    fprintf(f, "# HELP snooze_requests_total Responses queued, by status code.\n"
+               "# TYPE snooze_requests_total counter\n");
+    for (int i = 0; i < CODE_COUNT; i++)
+        fprintf(f, "snooze_requests_total{code=\"%s\"} %llu\n", code_names[i], req[i]);
 
-    /* Parse environment variables and CLI flags */
-    parse_arguments(argc, argv, &port, &message);
+    fprintf(f, "# HELP snooze_connections_accepted_total Connections accepted.\n"
+               "# TYPE snooze_connections_accepted_total counter\n"
+               "snooze_connections_accepted_total %llu\n"
+               "# HELP snooze_connections_open Connections currently open.\n"
+               "# TYPE snooze_connections_open gauge\n"
+               "snooze_connections_open %llu\n",
+            accepted, accepted > closed ? accepted - closed : 0);
 
-    /* Set up signals */
-    struct sigaction sa = { .sa_handler = handle_signal };
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGINT,  &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+    fprintf(f, "# HELP snooze_received_bytes_total Request bytes read, discarded bodies included.\n"
+               "# TYPE snooze_received_bytes_total counter\n"
+               "snooze_received_bytes_total %llu\n"
+               "# HELP snooze_sent_bytes_total Response bytes written.\n"
+               "# TYPE snooze_sent_bytes_total counter\n"
+               "snooze_sent_bytes_total %llu\n",
+            in, out);
 
-    /* Create listening socket */
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) { perror("socket"); exit(EXIT_FAILURE); }
+    fprintf(f, "# HELP snooze_timeouts_total Connections closed by a deadline, by what they waited for.\n"
+               "# TYPE snooze_timeouts_total counter\n");
+    for (int i = PHASE_NONE + 1; i < PHASE_COUNT; i++)
+        fprintf(f, "snooze_timeouts_total{phase=\"%s\"} %llu\n", phase_names[i], tmo[i]);
 
-    /* Allow immediate re-bind after restart */
-    int optval = 1;
-    ret = setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR,
-                     &optval, sizeof(optval));
-    if (ret < 0) { perror("setsockopt"); close(server_fd); exit(EXIT_FAILURE); }
+    fprintf(f, "# HELP snooze_log_dumps_dropped_total Request dumps dropped with the log ring full.\n"
+               "# TYPE snooze_log_dumps_dropped_total counter\n"
+               "snooze_log_dumps_dropped_total %zu\n",
+            atomic_load_explicit(&logq.dropped, memory_order_relaxed));
 
-    /* Bind to all interfaces on the chosen port */
-    struct sockaddr_in addr = {0};
-    addr.sin_family      = AF_INET;
-    addr.sin_port        = htons(port);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    unsigned long long overflows, drops;
+    if (read_listen_overflows(&overflows, &drops) == 0)
+        fprintf(f, "# HELP snooze_listen_overflows_total SYNs refused with an accept queue full (whole netns).\n"
+                   "# TYPE snooze_listen_overflows_total counter\n"
+                   "snooze_listen_overflows_total %llu\n"
+                   "# HELP snooze_listen_drops_total Incoming connections dropped by listeners (whole netns).\n"
+                   "# TYPE snooze_listen_drops_total counter\n"
+                   "snooze_listen_drops_total %llu\n",
+                overflows, drops);
 
-    if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("bind"); close(server_fd); exit(EXIT_FAILURE);
+    fprintf(f, "# HELP snooze_request_duration_seconds From the first byte read to the response written.\n"
+               "# TYPE snooze_request_duration_seconds histogram\n");
+    unsigned long long cum = 0;
+    for (unsigned i = 0; i + 1 < LAT_BUCKETS; i++) {
+        cum += lat[i];
+        uint64_t le = lat_lower(i + 1);
+        fprintf(f, "snooze_request_duration_seconds_bucket{le=\"%llu.%06llu\"} %llu\n",
+                (unsigned long long)(le / 1000000), (unsigned long long)(le % 1000000), cum);
     }
+    cum += lat[LAT_BUCKETS - 1];
+    fprintf(f, "snooze_request_duration_seconds_bucket{le=\"+Inf\"} %llu\n"
+               "snooze_request_duration_seconds_sum %llu.%06llu\n"
+               "snooze_request_duration_seconds_count %llu\n",
+            cum, sum_us / 1000000, sum_us % 1000000, cum);
 
-    if (listen(server_fd, 10) < 0) {
-        perror("listen"); close(server_fd); exit(EXIT_FAILURE);
-    }
+    if (fclose(f) != 0) { free(buf); return NULL; }
+    return buf;
+}
+
+/*------------------------------------------------------------
+ *  Per-connection state machine
+ *
+ *    READ_HEADERS → READ_BODY → queue response ─→ write → (drain + close)
+ *         ↑                           │                  │
+ *         └──── next pipelined ───────┘                  │
+ *         └──────────────── keep-alive ──────────────────┘
+ *
+ *  The state machine only manipulates buffers; the engines
+ *  (epoll below, io_uring further down) own the actual I/O.
+ *  With epoll every socket is non-blocking and registered
+ *  edge-triggered, so each handler runs until the kernel
+ *  reports EAGAIN and then simply returns to the event loop.
+ *-----------------------------------------------------------*/
+enum ev_kind {
+    EV_LISTENER,         /* a worker's listening socket        */
+    EV_STOP,             /* shutdown eventfd shared by workers  */
+    EV_CONN,             /* a client connection                 */
+};
 
-    printf("snooze is listening on port %d\n", port);
+/* First member of everything registered with epoll (data.ptr) */
+struct ev_tag {
+    enum ev_kind kind;
+};
 
-    /*--------------------------------------------------------
-     *  Accept–loop: one connection at a time (trivial server)
-     *-------------------------------------------------------*/
-    while (keep_running) {
-        int client_fd = accept(server_fd, NULL, NULL);
-        if (client_fd < 0) {
-            if (errno == EINTR) break;
-            perror("accept");
-            continue;
-        }
+/* Requests refused before they are buffered (see rejects[]) */
+enum reject {
+    REJECT_NONE,
+    REJECT_BAD_REQUEST,          /* 400: malformed head               */
+    REJECT_BODY_TOO_LARGE,       /* 413: over --max-body-size         */
+    REJECT_HEADERS_TOO_LARGE,    /* 431: over --max-header-size or
+                                    HTTP_MAX_HEADERS                  */
+    REJECT_COUNT
+};
 
-        /* ONE clean block with the full request (headers + body if Content-Length). */
-        log_full_request_blocking(client_fd);
+enum conn_state {
+    CONN_READ_HEADERS,   /* buffering until "\r\n\r\n"         */
+    CONN_READ_BODY,      /* buffering Content-Length bytes      */
+    CONN_LINGER,         /* half-closed, draining until EOF     */
+    CONN_CLOSING,        /* io_uring CLOSE posted, no deadline  */
+};
 
-        /* Respond and close. */
-        send_http_response(client_fd, message);
-    }
+/* Intrusive circular list; a detached node points at itself */
+struct dlist {
+    struct dlist *prev, *next;
+};
 
-    /* Clean up */
-    close(server_fd);
+static void dlist_init(struct dlist *n) { n->prev = n->next = n; }
+static int  dlist_empty(const struct dlist *n) { return n->next == n; }
+
+static void dlist_del(struct dlist *n)
+{
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    dlist_init(n);
+}
+
+static void dlist_add_tail(struct dlist *head, struct dlist *n)
+{
+    n->prev = head->prev;
+    n->next = head;
+    head->prev->next = n;
+    head->prev = n;
+}
+
+#define container_of(p, type, member) \
+    ((type*)(void*)((char*)(p) - offsetof(type, member)))
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Hierarchical timer wheel: TW_LEVELS rings of TW_SLOTS lists,
+ * level L holding deadlines up to TW_SLOTS^(L+1) ticks away.
+ * Arming and cancelling are a list insert / unlink; each tick
+ * expires one level-0 slot and, every TW_SLOTS ticks, cascades
+ * the next level's slot down. The timers are embedded dlist
+ * nodes, so nothing is allocated and no syscall is made per
+ * timer. Four levels of 64 at 100 ms cover about 19 days.
+ */
+#define TW_BITS     6
+#define TW_SLOTS    (1u << TW_BITS)
+#define TW_LEVELS   4
+#define TW_TICK_MS  100
+
+struct timer_wheel {
+    uint64_t     now;          /* last tick processed                 */
+    unsigned     armed;        /* timers currently in the wheel       */
+    struct dlist slots[TW_LEVELS][TW_SLOTS];
+};
+
+struct timer {
+    struct dlist link;         /* detached when not armed             */
+    uint64_t     expires;      /* tick                                */
+};
+
+static uint64_t tw_tick_now(void)
+{
+    return (uint64_t)now_ms() / TW_TICK_MS;
+}
+
+static void tw_init(struct timer_wheel *tw)
+{
+    tw->now   = tw_tick_now();
+    tw->armed = 0;
+    for (int l = 0; l < TW_LEVELS; l++)
+        for (unsigned i = 0; i < TW_SLOTS; i++) dlist_init(&tw->slots[l][i]);
+}
+
+/*
+ * Files t on the lowest level whose current rotation contains its
+ * deadline, so its slot comes up (or cascades) before it is due.
+ * The wheel must not own t yet.
+ */
+static void tw_place(struct timer_wheel *tw, struct timer *t)
+{
+    const int top = TW_BITS * (TW_LEVELS - 1);
+    uint64_t max = ((uint64_t)(TW_SLOTS - 1) << top) - 1;
+    if (t->expires < tw->now)       t->expires = tw->now;
+    if (t->expires - tw->now > max) t->expires = tw->now + max;
+
+    int level = 0;
+    while (level < TW_LEVELS - 1 &&
+           t->expires >> (TW_BITS * (level + 1)) != tw->now >> (TW_BITS * (level + 1)))
+        level++;
+    unsigned slot = (unsigned)(t->expires >> (TW_BITS * level)) & (TW_SLOTS - 1);
+    dlist_add_tail(&tw->slots[level][slot], &t->link);
+}
+
+static void tw_arm(struct timer_wheel *tw, struct timer *t, unsigned ms)
+{
+    uint64_t now = tw_tick_now();
+    if (tw->armed == 0) tw->now = now;         /* an idle wheel's clock is stale */
+    if (!dlist_empty(&t->link)) dlist_del(&t->link);
+    else                        tw->armed++;
+    t->expires = now + (ms + TW_TICK_MS - 1) / TW_TICK_MS;
+    if (t->expires <= tw->now) t->expires = tw->now + 1;   /* this tick is done */
+    tw_place(tw, t);
+}
+
+static void tw_cancel(struct timer_wheel *tw, struct timer *t)
+{
+    if (dlist_empty(&t->link)) return;
+    dlist_del(&t->link);
+    tw->armed--;
+}
+
+/*
+ * Advances to the current tick, moving every timer that fired
+ * onto `expired` (detached from the wheel). Returns the ms until
+ * the next tick, or -1 when nothing is armed.
+ */
+static int tw_advance(struct timer_wheel *tw, struct dlist *expired)
+{
+    uint64_t target = tw_tick_now();
+    if (tw->armed == 0) tw->now = target;      /* nothing to walk past */
+
+    while (tw->now < target) {
+        tw->now++;
+        for (int l = 1; l < TW_LEVELS; l++) {  /* cascade on wrap-around */
+            if (tw->now & (((uint64_t)1 << (TW_BITS * l)) - 1)) break;
+            struct dlist *head = &tw->slots[l][(tw->now >> (TW_BITS * l)) & (TW_SLOTS - 1)];
+            while (!dlist_empty(head)) {
+                struct dlist *n = head->next;
+                dlist_del(n);
+                tw_place(tw, container_of(n, struct timer, link));
+            }
+        }
+        struct dlist *head = &tw->slots[0][tw->now & (TW_SLOTS - 1)];
+        while (!dlist_empty(head)) {
+            struct dlist *n = head->next;
+            dlist_del(n);
+            dlist_add_tail(expired, n);
+            tw->armed--;
+        }
+    }
+    if (tw->armed == 0) return -1;
+    long long wait = (long long)(tw->now + 1) * TW_TICK_MS - now_ms();
+    return wait > 0 ? (int)wait : 0;
+}
+
+/*
+ * Per-worker connection slab. Receive buffers are page-aligned
+ * slots of one mmap'd region and connection objects are recycled
+ * through a free list, so accepting and closing never call malloc
+ * or free. With epoll a slot's pages are faulted in on first use;
+ * io_uring registers the slots as fixed buffers, which pins and
+ * faults in the whole registered prefix (4 MiB per worker by
+ * default) up front.
+ *
+ * A slot holds an ordinary request. The rare head or logged
+ * body that outgrows it moves to a heap buffer of
+ * conn_buf_size() (the overflow path) and returns to a slot
+ * once the connection has nothing buffered. Connections beyond
+ * the slots start on the heap the same way.
+ */
+#define CONN_SLOT_SIZE  4096    /* bytes per slot; most request heads fit */
+#define CONN_SLAB_SLOTS 1024    /* slots per worker (io_uring pins them)  */
+#define CONN_CHUNK      64      /* conn objects allocated at a time       */
+
+struct conn_slab {
+    char              *base;        /* CONN_SLAB_SLOTS slots (NULL: none)  */
+    size_t             slot_size;   /* page multiple                       */
+    size_t             cap;         /* usable bytes per slot               */
+    size_t             full_size;   /* overflow buffer: conn_buf_size()    */
+    int               *free;        /* stack of free slot indices          */
+    int                nfree;
+    int                registered;  /* io_uring: slots below are fixed bufs */
+    struct conn       *free_conns;  /* recycled objects                    */
+    struct conn_chunk *chunks;      /* every object ever allocated         */
+};
+
+struct conn {
+    _Alignas(8) struct ev_tag tag; /* must stay first; low bits of the
+                                      address carry the io_uring op   */
+    int              fd;
+    enum conn_state  state;
+
+    char            *req;      /* raw request bytes                   */
+    size_t           cap, len;
+    struct conn_slab *slab;    /* owner of the object (and of req
+                                  when slot >= 0)                     */
+    struct conn     *next_free;/* on slab->free_conns once closed     */
+    int              slot;
+    size_t           head;     /* start of the request being parsed   */
+    size_t           scanned;  /* head bytes already searched for CRLFCRLF */
+    size_t           hdr_end;  /* 0 until headers are complete        */
+    struct http_req  http;     /* index of the head, once complete    */
+    size_t           want;     /* bytes to buffer (hdrs + logged body) */
+    size_t           skip;     /* body bytes past want, never buffered */
+    size_t           discard;  /* of those, still unread in the kernel */
+    size_t           linger;   /* bytes still drained before closing  */
+    int              dump;     /* this request was sampled for logging */
+    enum reject      reject;   /* answer with an error and close      */
+    int              trunc_ok; /* recv(MSG_TRUNC) discards in-kernel   */
+    int              eof;      /* peer stopped sending                */
+    int              closing;  /* last queued response ends the conn  */
+    unsigned         served;   /* responses queued so far             */
+    struct metrics  *m;        /* the owning worker's counters        */
+    uint64_t         t_start;  /* us; first byte of the oldest
+                                  unanswered request (0: none)        */
+    unsigned         out_reqs; /* responses in out[] not yet written  */
+    char            *dyn;      /* malloc'd response in out[] (metrics) */
+
+    struct timer     timer;    /* deadline of the current phase       */
+    enum conn_phase  phase;    /* what the timer is armed for         */
+    int              progress; /* bytes moved since the last conn_arm() */
+
+    struct iovec     out[OUT_MAX]; /* queued responses                   */
+    int              out_cnt;
+    struct msghdr    msg;      /* io_uring SENDMSG over out[]         */
+    struct sockaddr_storage peer_addr;  /* from accept (AF_UNSPEC: not yet) */
+    socklen_t        peer_len;
+    char             peer[INET6_ADDRSTRLEN + 8]; /* "ip:port" once dumped */
+};
+
+struct conn_chunk {
+    struct conn_chunk *next;
+    struct conn        conns[CONN_CHUNK];
+};
+
+/* A listening socket; io_uring keeps its address in user_data */
+struct listener {
+    _Alignas(8) struct ev_tag tag;  /* must stay first */
+    int                  fd;
+    int                  unix_sock; /* AF_UNIX: no MSG_TRUNC discards      */
+    int                  shared;    /* unix: one socket for all workers    */
+    int                  parked;    /* io_uring: ACCEPT waits for a tick   */
+};
+
+/* Everything one event-loop thread owns; never shared */
+struct worker {
+    int                  id;
+    struct listener      listeners[MAX_LISTEN];  /* one per --listen */
+    int                  nlisteners;
+    int                  ep;
+    int                  admin;    /* --metrics-port: every request scrapes */
+    int                  spare_fd; /* closed to shed a connection at EMFILE */
+    struct conn_slab     slab;
+    struct metrics      *m;
+    struct timer_wheel   wheel;    /* every connection's current deadline */
+    pthread_t            tid;
+    const struct config *cfg;
+
+    /* request-dump sampling (--log-sample / --log-rate) */
+    unsigned long        log_seen;
+    double               log_tokens;
+    long long            log_refill_ms;
+    unsigned long        log_suppressed;
+};
+
+static void slab_init(struct conn_slab *s, size_t full_size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t align = page > 0 ? (size_t)page : 4096;
+
+    memset(s, 0, sizeof(*s));
+    s->full_size = full_size;
+    s->slot_size = (CONN_SLOT_SIZE + align - 1) & ~(align - 1);
+    s->cap       = s->slot_size < full_size ? s->slot_size : full_size;
+
+    /* without slots every connection simply lives on the heap */
+    void *base = mmap(NULL, (size_t)CONN_SLAB_SLOTS * s->slot_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    s->free = (int*)malloc(CONN_SLAB_SLOTS * sizeof(int));
+    if (base == MAP_FAILED || !s->free) {
+        if (base != MAP_FAILED) munmap(base, (size_t)CONN_SLAB_SLOTS * s->slot_size);
+        free(s->free);
+        s->free = NULL;
+        return;
+    }
+    s->base  = (char*)base;
+    s->nfree = CONN_SLAB_SLOTS;
+    for (int i = 0; i < CONN_SLAB_SLOTS; i++)   /* low slots first: io_uring may */
+        s->free[i] = CONN_SLAB_SLOTS - 1 - i;   /* register only a prefix        */
+}
+
+static void slab_destroy(struct conn_slab *s)
+{
+    if (s->base) munmap(s->base, (size_t)CONN_SLAB_SLOTS * s->slot_size);
+    free(s->free);
+    while (s->chunks) {
+        struct conn_chunk *next = s->chunks->next;
+        free(s->chunks);
+        s->chunks = next;
+    }
+}
+
+/* A recycled object if there is one, else a fresh chunk of them */
+static struct conn *slab_conn(struct conn_slab *s)
+{
+    if (!s->free_conns) {
+        struct conn_chunk *ch = (struct conn_chunk*)malloc(sizeof(*ch));
+        if (!ch) return NULL;
+        ch->next  = s->chunks;
+        s->chunks = ch;
+        for (int i = CONN_CHUNK - 1; i >= 0; i--) {
+            ch->conns[i].next_free = s->free_conns;
+            s->free_conns = &ch->conns[i];
+        }
+    }
+    struct conn *c = s->free_conns;
+    s->free_conns = c->next_free;
+    return c;
+}
+
+/* Moves an empty heap-backed connection into a free slot */
+static void conn_take_slot(struct conn *c)
+{
+    struct conn_slab *s = c->slab;
+    if (c->slot >= 0 || s->nfree == 0) return;
+    free(c->req);
+    c->slot = s->free[--s->nfree];
+    c->req  = s->base + (size_t)c->slot * s->slot_size;
+    c->cap  = s->cap;
+}
+
+/* The slab is embedded in its worker */
+static struct worker *conn_worker(const struct conn *c)
+{
+    return container_of(c->slab, struct worker, slab);
+}
+
+static void conn_release_buf(struct conn *c)
+{
+    if (c->slot >= 0) c->slab->free[c->slab->nfree++] = c->slot;
+    else              free(c->req);
+    c->slot = -1;
+    c->req  = NULL;
+}
+
+static struct conn *conn_new(struct worker *w, const struct listener *l, int fd)
+{
+    struct conn_slab *s = &w->slab;
+    struct conn *c = slab_conn(s);
+    if (!c) return NULL;
+    memset(c, 0, sizeof(*c));
+    c->slab = s;
+    c->slot = -1;
+
+    if (s->nfree > 0) {
+        conn_take_slot(c);
+    } else {
+        c->cap = s->cap;
+        c->req = (char*)malloc(c->cap);
+        if (!c->req) {
+            c->next_free  = s->free_conns;
+            s->free_conns = c;
+            return NULL;
+        }
+    }
+    dlist_init(&c->timer.link);
+    c->trunc_ok = !l->unix_sock;
+    c->tag.kind = EV_CONN;
+    c->fd       = fd;
+    c->state    = CONN_READ_HEADERS;
+    c->m        = w->m;
+    metric_add(&c->m->accepted, 1);
+    return c;
+}
+
+/* Frees the connection; the caller has already closed the socket */
+static void conn_destroy(struct conn *c)
+{
+    metric_add(&c->m->closed, 1);
+    tw_cancel(&conn_worker(c)->wheel, &c->timer);
+    conn_release_buf(c);
+    free(c->dyn);
+    c->dyn        = NULL;
+    c->next_free  = c->slab->free_conns;       /* recycled, never freed */
+    c->slab->free_conns = c;
+}
+
+static void conn_free(struct conn *c)
+{
+    graceful_close(c->fd);                     /* also removes it from epoll */
+    conn_destroy(c);
+}
+
+/*
+ * Unlogged request bodies are thrown away with recv(MSG_TRUNC):
+ * on TCP the kernel drops the bytes without copying them, so the
+ * sink is never written and chunks can be as large as the body.
+ * Sockets without that support copy into the sink instead.
+ */
+static char discard_sink[65536];
+
+static size_t discard_chunk(const struct conn *c, size_t n)
+{
+    if (!c->trunc_ok && n > sizeof(discard_sink)) n = sizeof(discard_sink);
+    if (n > (size_t)INT32_MAX) n = (size_t)INT32_MAX;
+    return n;
+}
+
+/*
+ * Lingering close. Closing a socket with unread data sends a RST,
+ * which can destroy the last response before the client has read
+ * it: a rejected body still on its way, or requests pipelined
+ * behind a Connection: close. So once the last response is out the
+ * write side is shut and the connection parked, discarding what
+ * arrives until the peer's EOF, LINGER_MAX_BYTES or
+ * --linger-timeout, whichever comes first.
+ */
+static void conn_start_linger(struct conn *c)
+{
+    conn_release_buf(c);                       /* nothing more is parsed */
+    c->state   = CONN_LINGER;
+    c->linger  = LINGER_MAX_BYTES;
+    c->discard = 0;
+}
+
+/* Accounts for n bytes drained while lingering; 1 once done */
+static int conn_lingered(struct conn *c, size_t n)
+{
+    metric_add(&c->m->bytes_in, n);
+    c->linger -= n < c->linger ? n : c->linger;
+    return n == 0 || c->linger == 0;
+}
+
+/*
+ * Where the next read should land and how much it may take.
+ * Requests already answered are compacted away first, so a
+ * pipelined burst costs one memmove per read, not per request.
+ * A full slot moves to an overflow buffer that holds a whole
+ * head plus the logged body, so once compacted a request always
+ * fits; NULL means no room at all.
+ */
+static char *conn_recv_window(struct conn *c, size_t *room)
+{
+    if (c->head > 0) {
+        c->len -= c->head;
+        memmove(c->req, c->req + c->head, c->len);
+        c->head = 0;
+    }
+
+    if (c->len == 0 && c->slot < 0) {
+        conn_take_slot(c);                     /* overflow over: back to the slab */
+    } else if (c->len == c->cap && c->cap < c->slab->full_size) {
+        char *big = (char*)malloc(c->slab->full_size);
+        if (!big) return NULL;
+        memcpy(big, c->req, c->len);
+        conn_release_buf(c);
+        c->req = big;
+        c->cap = c->slab->full_size;
+    }
+
+    *room = c->cap - c->len;
+    return *room > 0 ? c->req + c->len : NULL;
+}
+
+/*
+ * Request-dump sampling: 1 in --log-sample requests, then at most
+ * --log-rate dumps per second (a token bucket per worker holding
+ * up to one second's worth). Suppressed requests skip the dump
+ * formatting entirely and are only counted.
+ */
+static int log_sampled(struct worker *w)
+{
+    const struct config *cfg = w->cfg;
+
+    if (w->admin) return 0;                    /* scrapes are never dumped */
+
+    if (cfg->log_sample > 1 && w->log_seen++ % (unsigned long)cfg->log_sample != 0)
+        goto suppress;
+
+    if (cfg->log_rate > 0) {
+        double rate = (double)cfg->log_rate / cfg->workers;
+        double burst = rate < 1.0 ? 1.0 : rate;
+        long long now = now_ms();
+        w->log_tokens += (double)(now - w->log_refill_ms) * rate / 1000.0;
+        if (w->log_tokens > burst) w->log_tokens = burst;
+        w->log_refill_ms = now;
+        if (w->log_tokens < 1.0) goto suppress;
+        w->log_tokens -= 1.0;
+    }
+    return 1;
+
+suppress:
+    w->log_suppressed++;
+    return 0;
+}
+
+/*
+ * Returns 1 once the bytes at c->head hold a complete request.
+ *
+ * Only the part of the body the dump will show is buffered: once
+ * the headers are in, the request is sampled and anything past
+ * --log-body-max (or all of it, if the dump is skipped or
+ * headers-only) is left in c->skip to be discarded unread.
+ * Requests over the configured limits are complete as soon as
+ * that is known; they are answered with c->reject.
+ */
+static int conn_parse(struct worker *w, struct conn *c)
+{
+    const struct config *cfg = w->cfg;
+    const char *req = c->req + c->head;
+    size_t      len = c->len - c->head;
+
+    if (c->state == CONN_READ_HEADERS) {
+        size_t scan = len < cfg->max_header_size ? len : cfg->max_header_size;
+        c->hdr_end = find_headers_end(req, scan, &c->scanned);
+        if (!c->hdr_end) {
+            if (len < cfg->max_header_size) return 0;
+            c->reject = REJECT_HEADERS_TOO_LARGE;
+            c->want   = len;
+            c->state  = CONN_READ_BODY;
+            return 1;
+        }
+
+        size_t body = 0;
+        int r = http_parse(&c->http, req, c->hdr_end);
+        if (r == -2) {
+            c->reject = REJECT_HEADERS_TOO_LARGE;
+        } else if (r == 0) {
+            r = parse_content_length(&c->http, req, &body);
+            if (r == -2 || (cfg->max_body_size && body > cfg->max_body_size))
+                c->reject = REJECT_BODY_TOO_LARGE;
+        }
+        if (r == -1) c->reject = REJECT_BAD_REQUEST;
+        if (c->reject) {
+            c->dump  = log_sampled(w);
+            c->want  = c->hdr_end;
+            c->state = CONN_READ_BODY;
+            return 1;
+        }
+
+        size_t keep = body;
+        c->dump = log_sampled(w);
+        if (!c->dump || cfg->log_headers_only) keep = 0;
+        if (keep > cfg->log_body_max)          keep = cfg->log_body_max;
+
+        c->want  = c->hdr_end + keep;
+        c->skip  = body - keep;
+        c->state = CONN_READ_BODY;
+    }
+    return len >= c->want;
+}
+
+/*
+ * The client's address for dumps, formatted on the first one only.
+ * epoll's accept4() already recorded it; io_uring's multishot
+ * ACCEPT cannot, so those connections ask getpeername() then.
+ */
+static const char *conn_peer(struct conn *c)
+{
+    if (!c->peer[0]) {
+        if (c->peer_addr.ss_family == AF_UNSPEC) {
+            c->peer_len = sizeof(c->peer_addr);
+            if (getpeername(c->fd, (struct sockaddr*)&c->peer_addr, &c->peer_len) < 0)
+                c->peer_addr.ss_family = AF_UNSPEC;
+        }
+        format_sockaddr(&c->peer_addr, c->peer_len, c->peer, sizeof(c->peer));
+    }
+    return c->peer;
+}
+
+/* Accounts for n freshly received bytes (0 = peer closed) */
+static void conn_received(struct conn *c, size_t n)
+{
+    if (n == 0) {
+        c->eof     = 1;
+        c->discard = 0;                        /* nothing more will come */
+    }
+    if (n > 0 && !c->t_start) c->t_start = now_us();
+    if (n > 0) c->progress = 1;
+    metric_add(&c->m->bytes_in, n);
+    c->len += n;
+}
+
+/* Accounts for n body bytes thrown away unread */
+static void conn_discarded(struct conn *c, size_t n)
+{
+    if (n == 0) {
+        conn_received(c, 0);
+        return;
+    }
+    metric_add(&c->m->bytes_in, n);
+    c->progress = 1;
+    c->discard -= n < c->discard ? n : c->discard;
+}
+
+/* Everything queued is written: record the latency of those requests */
+static void conn_sent(struct conn *c)
+{
+    if (c->out_reqs > 0) {
+        uint64_t now = now_us(), us = c->t_start ? now - c->t_start : 0;
+        metric_add(&c->m->latency[lat_index(us)], c->out_reqs);
+        metric_add(&c->m->latency_sum_us, us * c->out_reqs);
+        /* a pipelined request already buffered starts now */
+        c->t_start  = c->len > c->head ? now : 0;
+        c->out_reqs = 0;
+    }
+    free(c->dyn);
+    c->dyn = NULL;
+}
+
+/* Closing and nothing left to send or discard? */
+static int conn_done(const struct conn *c)
+{
+    return c->closing && c->out_cnt == 0 && c->discard == 0;
+}
+
+/* Waiting for a follow-up request with nothing buffered? */
+static int conn_is_idle(const struct conn *c)
+{
+    return c->served > 0 && c->len == c->head && c->out_cnt == 0;
+}
+
+static enum conn_phase conn_phase(const struct conn *c)
+{
+    if (c->state == CONN_CLOSING)        return PHASE_NONE;
+    if (c->state == CONN_LINGER)         return PHASE_LINGER;
+    if (c->out_cnt > 0)                  return PHASE_WRITE;
+    if (c->discard > 0)                  return PHASE_BODY;
+    if (conn_is_idle(c))                 return PHASE_IDLE;
+    if (c->state == CONN_READ_HEADERS)   return PHASE_HEADERS;
+    return PHASE_BODY;
+}
+
+/*
+ * Re-arms the connection's deadline once it stops to wait. The
+ * header deadline runs from the start of the head, so one
+ * trickled in a byte at a time still times out; the others
+ * restart whenever bytes moved (for an idle connection that
+ * means another request was served in between).
+ */
+static void conn_arm(struct worker *w, struct conn *c)
+{
+    const struct config *cfg = w->cfg;
+    enum conn_phase phase = conn_phase(c);
+    int progress = c->progress;
+    c->progress = 0;
+    if (phase == c->phase && !(progress && phase != PHASE_HEADERS))
+        return;
+    c->phase = phase;
+
+    int secs = 0;
+    switch (phase) {
+        case PHASE_HEADERS: secs = cfg->header_timeout;    break;
+        case PHASE_BODY:    secs = cfg->body_timeout;      break;
+        case PHASE_WRITE:   secs = cfg->write_timeout;     break;
+        case PHASE_IDLE:    secs = cfg->keepalive_timeout; break;
+        case PHASE_LINGER:  secs = cfg->linger_timeout;    break;
+        default:                                           break;
+    }
+    if (secs > 0) tw_arm(&w->wheel, &c->timer, (unsigned)secs * 1000);
+    else          tw_cancel(&w->wheel, &c->timer);
+}
+
+/* Pops the next connection whose deadline passed, or NULL */
+static struct conn *conn_expired(struct dlist *expired)
+{
+    if (dlist_empty(expired)) return NULL;
+    struct conn *c = container_of(expired->next, struct conn, timer.link);
+    dlist_del(&c->timer.link);
+    metric_add(&c->m->timeouts[c->phase], 1);
+    return c;
+}
+
+/*------------------------------------------------------------
+ *  Responses
+ *
+ *  The message never changes after parse_arguments(), so each
+ *  variant (keep-alive / close) is serialized once at startup
+ *  into one contiguous, cache-line-aligned buffer: status line,
+ *  headers and body. Answering a request is then a single
+ *  iovec pointing at constant memory — no formatting at all.
+ *  The error responses for rejected requests are built the
+ *  same way and always close the connection.
+ *
+ *  A large --message-file body is the exception: the file is
+ *  mapped once and stays separate, a second iovec pointing into
+ *  the mapping. The epoll engine turns that iovec back into a
+ *  file offset and hands it to sendfile(), so the body never
+ *  passes through user space; io_uring sends the mapped pages.
+ *
+ *  The body is also compressed once at startup with every
+ *  encoder built in (gzip, zstd, brotli), keeping the variants
+ *  that are actually smaller; each request picks one from its
+ *  Accept-Encoding, so nothing is compressed per request.
+ *
+ *  Every variant carries a strong ETag (a hash of the body plus
+ *  the coding) and has a prebuilt 304 twin, sent instead when
+ *  If-None-Match already names that ETag.
+ *-----------------------------------------------------------*/
+struct response {
+    char       *data;      /* status line + headers (+ inline body) */
+    size_t      len;
+    const char *body;      /* mapped file body sent after data, or NULL */
+    size_t      body_len;
+};
+
+static struct response responses[ENC_COUNT][2];  /* [encoding][keep_alive]; data
+                                                    NULL if the variant is absent */
+static struct response not_modified[ENC_COUNT][2];  /* 304 twins of responses[] */
+static struct response rejects[REJECT_COUNT];
+static char            etags[ENC_COUNT][40];        /* quoted, per variant */
+
+static struct {
+    int     fd;
+    char   *map;
+    size_t  size;
+} body_file = { .fd = -1 };
+
+/*
+ * Opens and maps --message-file. Small files are copied into
+ * *small instead (malloc'd) and inlined like --message.
+ */
+static int load_message_file(const char *path, char **small, size_t *small_len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) { perror(path); if (fd >= 0) close(fd); return -1; }
+
+    size_t size = (size_t)st.st_size;
+    char *map = size > 0 ? (char*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+    if (map == MAP_FAILED) { perror("mmap"); close(fd); return -1; }
+
+    if (size >= SENDFILE_MIN) {
+        madvise(map, size, MADV_WILLNEED);
+        body_file.fd   = fd;
+        body_file.map  = map;
+        body_file.size = size;
+        return 0;
+    }
+
+    *small = (char*)malloc(size + 1);
+    if (!*small) { perror("malloc"); close(fd); return -1; }
+    if (size > 0) {
+        memcpy(*small, map, size);
+        munmap(map, size);
+    }
+    *small_len = size;
+    close(fd);
+    return 0;
+}
+
+/* Does this queued iovec point into the mapped --message-file? */
+static int is_file_body(const struct iovec *iov)
+{
+    const char *p = (const char*)iov->iov_base;
+    return body_file.map && p >= body_file.map && p < body_file.map + body_file.size;
+}
+
+/*
+ * `extra` holds complete header lines (or ""), e.g. Content-Encoding.
+ * A NULL body means a bodiless 304: no Content-Type/Length at all.
+ */
+static int serialize_response(struct response *r, const char *status, const char *extra,
+                              const char *body, size_t body_len,
+                              int external, int keep_alive)
+{
+    static const char fmt[] =
+        "HTTP/1.1 %s\r\n"
+        "Server: snooze\r\n"
+        "Content-Type: text/html; charset=utf-8\r\n"
+        "Content-Length: %zu\r\n"
+        "%s"
+        "Connection: %s\r\n"
+        "\r\n";
+    static const char fmt_nobody[] =
+        "HTTP/1.1 %s\r\n"
+        "Server: snooze\r\n"
+        "%s"
+        "Connection: %s\r\n"
+        "\r\n";
+    const char *conn_hdr = keep_alive ? "keep-alive" : "close";
+
+    int hdr_len = body ? snprintf(NULL, 0, fmt, status, body_len, extra, conn_hdr)
+                       : snprintf(NULL, 0, fmt_nobody, status, extra, conn_hdr);
+    if (hdr_len < 0) { perror("snprintf"); return -1; }
+
+    size_t len = (size_t)hdr_len + (external ? 0 : body_len);
+    size_t cap = (len + 1 + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    char *buf = (char*)aligned_alloc(CACHE_LINE, cap);
+    if (!buf) { perror("aligned_alloc"); return -1; }
+
+    if (body) snprintf(buf, (size_t)hdr_len + 1, fmt, status, body_len, extra, conn_hdr);
+    else      snprintf(buf, (size_t)hdr_len + 1, fmt_nobody, status, extra, conn_hdr);
+    if (body && !external) memcpy(buf + hdr_len, body, body_len);
+
+    r->data     = buf;
+    r->len      = len;
+    r->body     = external ? body : NULL;
+    r->body_len = external ? body_len : 0;
+    return 0;
+}
+
+/*
+ * Compresses the body with one encoder at its strongest setting.
+ * Returns 0 with a malloc'd *out, or -1 if the encoder is not
+ * built in or fails.
+ */
+static int compress_body(enum encoding enc, const char *in, size_t len,
+                         char **out, size_t *out_len)
+{
+    switch (enc) {
+#ifdef SNOOZE_HAVE_ZLIB
+        case ENC_GZIP: {
+            z_stream zs;
+            memset(&zs, 0, sizeof(zs));
+            if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                             Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+            size_t cap = deflateBound(&zs, (uLong)len);
+            *out = (char*)malloc(cap);
+            if (!*out) { deflateEnd(&zs); return -1; }
+            zs.next_in   = (Bytef*)in;
+            zs.avail_in  = (uInt)len;
+            zs.next_out  = (Bytef*)*out;
+            zs.avail_out = (uInt)cap;
+            int rc = deflate(&zs, Z_FINISH);
+            *out_len = zs.total_out;
+            deflateEnd(&zs);
+            if (rc != Z_STREAM_END) { free(*out); return -1; }
+            return 0;
+        }
+#endif
+#ifdef SNOOZE_HAVE_ZSTD
+        case ENC_ZSTD: {
+            size_t cap = ZSTD_compressBound(len);
+            *out = (char*)malloc(cap);
+            if (!*out) return -1;
+            *out_len = ZSTD_compress(*out, cap, in, len, 19);
+            if (ZSTD_isError(*out_len)) { free(*out); return -1; }
+            return 0;
+        }
+#endif
+#ifdef SNOOZE_HAVE_BROTLI
+        case ENC_BR: {
+            size_t cap = BrotliEncoderMaxCompressedSize(len);
+            if (cap == 0) return -1;
+            *out = (char*)malloc(cap);
+            if (!*out) return -1;
+            *out_len = cap;
+            if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+                                       BROTLI_MODE_TEXT, len, (const uint8_t*)in,
+                                       out_len, (uint8_t*)*out)) {
+                free(*out);
+                return -1;
+            }
+            return 0;
+        }
+#endif
+        default:
+            (void)in; (void)len; (void)out; (void)out_len;
+            return -1;
+    }
+}
+
+/* 64-bit FNV-1a: the ETag only has to change when the body does */
+static uint64_t body_hash(const char *p, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* The 200 and 304 responses of one variant, keep-alive and close */
+static int build_variant(enum encoding e, const char *body, size_t body_len,
+                         int external, int vary, uint64_t hash)
+{
+    int n = e == ENC_IDENTITY
+          ? snprintf(etags[e], sizeof(etags[e]), "\"%016llx\"", (unsigned long long)hash)
+          : snprintf(etags[e], sizeof(etags[e]), "\"%016llx-%s\"", (unsigned long long)hash, enc_names[e]);
+    if (n < 0 || (size_t)n >= sizeof(etags[e])) return -1;
+
+    /* worst case: every line present, the longest encoding name */
+    char extra[sizeof("Content-Encoding: identity\r\nVary: Accept-Encoding\r\nETag: \r\n") +
+               sizeof(etags[0])];
+    n = snprintf(extra, sizeof(extra), "%s%s%s%sETag: %s\r\n",
+                 e != ENC_IDENTITY ? "Content-Encoding: " : "",
+                 e != ENC_IDENTITY ? enc_names[e] : "",
+                 e != ENC_IDENTITY ? "\r\n" : "",
+                 vary ? "Vary: Accept-Encoding\r\n" : "", etags[e]);
+    if (n < 0 || (size_t)n >= sizeof(extra)) return -1;
+
+    for (int ka = 0; ka < 2; ka++) {
+        if (serialize_response(&responses[e][ka], "200 OK", extra, body, body_len, external, ka) < 0 ||
+            serialize_response(&not_modified[e][ka], "304 Not Modified", extra, NULL, 0, 0, ka) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int build_responses(const char *message, size_t message_len)
+{
+    static const char *const reject_status[REJECT_COUNT] = {
+        [REJECT_BAD_REQUEST]       = "400 Bad Request",
+        [REJECT_BODY_TOO_LARGE]    = "413 Content Too Large",
+        [REJECT_HEADERS_TOO_LARGE] = "431 Request Header Fields Too Large",
+    };
+
+    const int   external = body_file.map != NULL;
+    const char *body     = external ? body_file.map  : message;
+    size_t      body_len = external ? body_file.size : message_len;
+
+    /* compressed variants first: identity needs Vary only if any exist */
+    const uint64_t hash = body_hash(body, body_len);
+    int vary = 0;
+    for (int e = ENC_IDENTITY + 1; e < ENC_COUNT; e++) {
+        char *z;
+        size_t zlen;
+        if (compress_body((enum encoding)e, body, body_len, &z, &zlen) < 0) continue;
+        if (zlen >= body_len) { free(z); continue; }  /* not worth it */
+
+        int rc = build_variant((enum encoding)e, z, zlen, 0, 1, hash);
+        free(z);
+        if (rc < 0) return -1;
+        vary = 1;
+    }
+    if (build_variant(ENC_IDENTITY, body, body_len, external, vary, hash) < 0) return -1;
+
+    for (int i = REJECT_NONE + 1; i < REJECT_COUNT; i++) {
+        char text[64];
+        int n = snprintf(text, sizeof(text), "%s\n", reject_status[i]);
+        if (serialize_response(&rejects[i], reject_status[i], "", text, (size_t)n, 0, 0) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void free_responses(void)
+{
+    for (int e = 0; e < ENC_COUNT; e++) {
+        for (int ka = 0; ka < 2; ka++) {
+            free(responses[e][ka].data);
+            free(not_modified[e][ka].data);
+        }
+    }
+    for (int i = 0; i < REJECT_COUNT; i++) free(rejects[i].data);
+    if (body_file.map) {
+        munmap(body_file.map, body_file.size);
+        close(body_file.fd);
+    }
+}
+
+/* A scrape answer: rendered per request, freed once it is written */
+static char *metrics_response(int keep_alive, size_t *len)
+{
+    size_t body_len;
+    char *body = metrics_render(&body_len);
+    if (!body) return NULL;
+
+    char hdr[256];
+    int hdr_len = snprintf(hdr, sizeof(hdr),
+        "HTTP/1.1 200 OK\r\n"
+        "Server: snooze\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: %zu\r\n"
+        "Cache-Control: no-store\r\n"
+        "Connection: %s\r\n"
+        "\r\n",
+        body_len, keep_alive ? "keep-alive" : "close");
+
+    char *resp = (char*)malloc((size_t)hdr_len + body_len);
+    if (resp) {
+        memcpy(resp, hdr, (size_t)hdr_len);
+        memcpy(resp + hdr_len, body, body_len);
+        *len = (size_t)hdr_len + body_len;
+    }
+    free(body);
+    return resp;
+}
+
+/* Does the request target --metrics-path (query string ignored)? */
+static int is_metrics_request(const struct config *cfg, const struct http_req *h, const char *req)
+{
+    if (!cfg->metrics_path) return 0;
+    const char *p = req + h->path.off;
+    size_t len = h->path.len;
+    const char *q = (const char*)memchr(p, '?', len);
+    if (q) len = (size_t)(q - p);
+    return len == strlen(cfg->metrics_path) && memcmp(p, cfg->metrics_path, len) == 0;
+}
+
+/* Best variant we have for the request's Accept-Encoding */
+static enum encoding pick_encoding(const struct http_req *h, const char *req)
+{
+    size_t vlen;
+    const char *v = http_header(h, req, HDR_ACCEPT_ENCODING, &vlen);
+    if (!v) return ENC_IDENTITY;
+
+    int q[ENC_COUNT];
+    accept_encoding_weights(v, vlen, q);
+
+    enum encoding best = ENC_IDENTITY;
+    for (int e = ENC_IDENTITY + 1; e < ENC_COUNT; e++) {
+        if (responses[e][0].data && q[e] > 0 && q[e] >= q[best])
+            best = (enum encoding)e;
+    }
+    return best;
+}
+
+/* The request at c->head is complete: dump it and queue the response */
+static void conn_queue_response(struct worker *w, struct conn *c)
+{
+    const struct config *cfg = w->cfg;
+    const char *req  = c->req + c->head;
+    size_t      have = c->len - c->head;
+
+    int keep_alive = cfg->keepalive_timeout > 0 && !c->eof && c->hdr_end && !c->reject &&
+                     (cfg->keepalive_requests == 0 ||
+                      c->served + 1 < (unsigned)cfg->keepalive_requests) &&
+                     wants_keep_alive(&c->http, req);
+
+    /* ONE clean block with the full request (headers + body if Content-Length).
+     * A closing connection without a framed body logs everything it
+     * received, as it always has; otherwise the dump stops at the body. */
+    if (!c->hdr_end) c->dump = log_sampled(w);  /* peer closed mid-headers */
+    if (c->dump) {
+        size_t dump = have;
+        if (keep_alive || ((c->want > c->hdr_end || c->skip) && c->want < have)) dump = c->want;
+        if (cfg->log_headers_only && c->hdr_end && c->hdr_end < dump) dump = c->hdr_end;
+        size_t omitted = cfg->log_headers_only ? 0 : c->skip;
+        log_request_dump(conn_peer(c), req, dump, omitted);
+    }
+
+    static const enum metric_code reject_codes[REJECT_COUNT] = {
+        [REJECT_BAD_REQUEST]       = CODE_400,
+        [REJECT_BODY_TOO_LARGE]    = CODE_413,
+        [REJECT_HEADERS_TOO_LARGE] = CODE_431,
+    };
+    const struct response *r = NULL;
+    struct response scrape;
+    enum metric_code code = CODE_200;
+    if (c->reject) {
+        r    = &rejects[c->reject];
+        code = reject_codes[c->reject];
+    } else if (c->hdr_end && (w->admin || is_metrics_request(cfg, &c->http, req)) &&
+               (scrape.data = metrics_response(keep_alive, &scrape.len)) != NULL) {
+        scrape.body = NULL;
+        c->dyn = scrape.data;                  /* freed by conn_sent() */
+        r = &scrape;
+    } else {
+        enum encoding enc = c->hdr_end ? pick_encoding(&c->http, req) : ENC_IDENTITY;
+        size_t vlen;
+        const char *inm = c->hdr_end ? http_header(&c->http, req, HDR_IF_NONE_MATCH, &vlen) : NULL;
+        int match = inm && etag_matches(inm, vlen, etags[enc]);
+        r    = match ? &not_modified[enc][keep_alive] : &responses[enc][keep_alive];
+        code = match ? CODE_304 : CODE_200;
+    }
+    c->out[c->out_cnt].iov_base  = r->data;
+    c->out[c->out_cnt++].iov_len = r->len;
+    if (r->body) {
+        c->out[c->out_cnt].iov_base  = (void*)r->body;
+        c->out[c->out_cnt++].iov_len = r->body_len;
+    }
+    c->served++;
+    c->out_reqs++;
+    metric_add(&c->m->requests[code], 1);
+
+    /* the body past the dump: skip what is buffered, discard the rest */
+    size_t used = c->want < have ? c->want : have;
+    size_t buffered = have - used < c->skip ? have - used : c->skip;
+    c->discard = c->eof ? 0 : c->skip - buffered;
+
+    if (!keep_alive) {
+        c->closing = 1;
+        return;
+    }
+    c->head   += used + buffered;              /* next pipelined request */
+    c->scanned = 0;
+    c->hdr_end = 0;
+    c->want    = 0;
+    c->skip    = 0;
+    c->state   = CONN_READ_HEADERS;
+    c->phase   = PHASE_NONE;                   /* its head gets a fresh deadline */
+}
+
+/*
+ * Walks every complete request already buffered and queues its
+ * response, so a pipelined burst is answered with one write.
+ * Returns 1 if anything is queued.
+ */
+static int conn_process(struct worker *w, struct conn *c)
+{
+    while (!c->closing && c->discard == 0 && !c->dyn && c->out_cnt + 2 <= OUT_MAX) {
+        if (!conn_parse(w, c)) {
+            if (!c->eof) break;
+            /* peer closed: between requests that is just goodbye,
+             * otherwise log whatever arrived (as before) */
+            if (c->served > 0 && c->len == c->head) {
+                c->closing = 1;
+                break;
+            }
+        }
+        conn_queue_response(w, c);
+    }
+    return c->out_cnt > 0;
+}
+
+/*------------------------------------------------------------
+ *  epoll engine
+ *-----------------------------------------------------------*/
+
+/*
+ * Reads whatever the kernel has. Returns 0 on EAGAIN, 1 when it
+ * stopped early (peer closed, or a full buffer already holds a
+ * request to answer) and -1 on a hard error.
+ */
+static int conn_read(struct worker *w, struct conn *c)
+{
+    while (!c->eof) {
+        if (c->discard > 0) {                  /* unlogged body: drop it in-kernel */
+            ssize_t n = recv(c->fd, discard_sink, discard_chunk(c, c->discard), MSG_TRUNC);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                return -1;
+            }
+            conn_discarded(c, (size_t)n);
+            continue;
+        }
+        if (c->closing) return 1;              /* nothing more to read */
+
+        if (c->len == c->cap && c->head < c->len && conn_parse(w, c))
+            return 1;                          /* buffer full: answer first */
+
+        size_t room;
+        char *dst = conn_recv_window(c, &room);
+        if (!dst) return -1;
+
+        ssize_t n = recv(c->fd, dst, room, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        conn_received(c, (size_t)n);
+    }
+    return 1;
+}
+
+/* Drops n written bytes from out[], keeping the rest at the front */
+static void conn_consume(struct conn *c, size_t n)
+{
+    struct iovec *iov = c->out;
+    while (c->out_cnt > 0 && n >= iov->iov_len) {
+        n -= iov->iov_len;
+        iov++; c->out_cnt--;
+    }
+    if (c->out_cnt > 0) {
+        iov->iov_base = (char*)iov->iov_base + n;
+        iov->iov_len -= n;
+    }
+    if (iov != c->out) memmove(c->out, iov, (size_t)c->out_cnt * sizeof(*iov));
+}
+
+/*
+ * Writes every queued response with as few sendmsg() calls as the
+ * socket allows (sendfile() for a mapped file body). Returns 1 when
+ * everything is out, 0 on EAGAIN and -1 on a hard error.
+ */
+static int conn_write(struct conn *c)
+{
+    struct iovec *iov = c->out;
+    while (c->out_cnt > 0) {
+        /* memory entries in one sendmsg, file bodies via sendfile */
+        int mem = 0;
+        while (mem < c->out_cnt && !is_file_body(&iov[mem])) mem++;
+
+        ssize_t n;
+        if (mem > 0) {
+            struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)mem };
+            n = sendmsg(c->fd, &msg, MSG_NOSIGNAL | (mem < c->out_cnt ? MSG_MORE : 0));
+        } else {
+            off_t off = (off_t)((const char*)iov->iov_base - body_file.map);
+            n = sendfile(c->fd, body_file.fd, &off, iov->iov_len);
+            if (n == 0) return -1;             /* file shrank under us */
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        metric_add(&c->m->bytes_out, (size_t)n);
+        c->progress = 1;
+        conn_consume(c, (size_t)n);
+    }
+    return 1;
+}
+
+/* Starts or continues a lingering close; -1 once c can be closed */
+static int conn_linger(struct worker *w, struct conn *c)
+{
+    if (c->state != CONN_LINGER) {
+        if (c->eof || w->cfg->linger_timeout == 0) return -1;
+        shutdown(c->fd, SHUT_WR);
+        conn_start_linger(c);
+    }
+    for (;;) {
+        ssize_t n = recv(c->fd, discard_sink, discard_chunk(c, c->linger), MSG_TRUNC | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (conn_lingered(c, (size_t)n)) return -1;
+    }
+}
+
+/*
+ * Drives one connection as far as it can go. Returns -1 once
+ * the connection is finished and must be freed.
+ */
+static int conn_handle(struct worker *w, struct conn *c)
+{
+    if (c->state == CONN_LINGER) return conn_linger(w, c);
+    for (;;) {
+        if (c->out_cnt > 0) {
+            int r = conn_write(c);
+            if (r == 0) return 0;
+            if (r < 0) return -1;
+            conn_sent(c);
+        }
+        if (conn_done(c)) return conn_linger(w, c);
+
+        /* Persistent: answer anything already buffered first,
+         * then keep reading (edge-triggered: until EAGAIN). */
+        if (conn_process(w, c)) continue;
+        if (conn_done(c)) return conn_linger(w, c);
+
+        int r = conn_read(w, c);
+        if (r < 0) return -1;
+        if (conn_process(w, c)) continue;
+        if (conn_done(c)) return conn_linger(w, c);
+        if (r == 0) return 0;
+    }
+}
+
+/*------------------------------------------------------------
+ *  Workers
+ *
+ *  Each worker owns its own SO_REUSEPORT listening sockets (one
+ *  per --listen address, all in the same loop) and epoll
+ *  instance; the kernel spreads incoming connections across
+ *  the listeners, so no accept lock is shared.
+ *-----------------------------------------------------------*/
+static struct ev_tag stop_tag = { EV_STOP };
+static int stop_fd = -1;    /* eventfd; readable once shutdown begins */
+
+static int open_listener(const struct config *cfg, const struct listen_addr *la)
+{
+    struct listen_addr any4;
+    int fd = socket(la->ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 && errno == EAFNOSUPPORT && la->ss.ss_family == AF_INET6 && !la->v6only) {
+        /* dual-stack on a host without IPv6: plain 0.0.0.0 */
+        struct sockaddr_in *in4 = (struct sockaddr_in*)&any4.ss;
+        memset(&any4, 0, sizeof(any4));
+        in4->sin_family      = AF_INET;
+        in4->sin_port        = htons((uint16_t)sockaddr_port(&la->ss));
+        in4->sin_addr.s_addr = htonl(INADDR_ANY);
+        any4.len = sizeof(*in4);
+        la = &any4;
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    }
+    if (fd < 0) { perror("socket"); return -1; }
+
+    int tcp = la->ss.ss_family != AF_UNIX;
+    if (tcp) {
+        /* Allow immediate re-bind after restart, one socket per worker */
+        int optval = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+            perror("setsockopt"); close(fd); return -1;
+        }
+        /* explicit either way: net.ipv6.bindv6only must not decide */
+        if (la->ss.ss_family == AF_INET6 &&
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &la->v6only, sizeof(int)) < 0) {
+            perror("setsockopt(IPV6_V6ONLY)"); close(fd); return -1;
+        }
+    } else {
+        /* a socket file left by an earlier run would fail the bind */
+        const char *path = ((const struct sockaddr_un*)&la->ss)->sun_path;
+        struct stat st;
+        if (path[0] && stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    }
+
+    if (bind(fd, (const struct sockaddr*)&la->ss, la->len) < 0) {
+        char name[ADDR_NAME_MAX];
+        fprintf(stderr, "bind %s: %s\n", format_sockaddr(&la->ss, la->len, name, sizeof(name)),
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* Both are hints: an older kernel without them still serves */
+    if (tcp && cfg->defer_accept > 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &cfg->defer_accept, sizeof(int)) < 0)
+        perror("setsockopt(TCP_DEFER_ACCEPT)");
+    if (tcp && cfg->fastopen > 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &cfg->fastopen, sizeof(int)) < 0)
+        perror("setsockopt(TCP_FASTOPEN)");
+
+    if (listen(fd, cfg->backlog) < 0) {
+        perror("listen"); close(fd); return -1;
+    }
+    return fd;
+}
+
+/*
+ * Out of descriptors: a level-triggered listener (or a re-armed
+ * ACCEPT) would spin on EMFILE, so free the spare to accept and
+ * drop one waiting connection. Returns 0 if there is no spare.
+ * The poll() keeps an io_uring worker's blocking listener from
+ * parking here when nothing is queued.
+ */
+static int accept_shed(struct worker *w, struct listener *l)
+{
+    if (w->spare_fd < 0) return 0;
+    close(w->spare_fd);
+    struct pollfd pfd = { .fd = l->fd, .events = POLLIN };
+    if (poll(&pfd, 1, 0) > 0) {
+        int fd = accept(l->fd, NULL, NULL);
+        if (fd >= 0) close(fd);
+    }
+    w->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return 1;
+}
+
+/*------------------------------------------------------------
+ *  Accept a batch of pending connections
+ *
+ *  The listener is level-triggered, so stopping after
+ *  --accept-batch connections loses nothing: the rest wake
+ *  the next epoll_wait(), after the I/O already in flight.
+ *  accept4() hands back sockets that are non-blocking and
+ *  close-on-exec already, along with the peer address for
+ *  dumps, one syscall per connection.
+ *-----------------------------------------------------------*/
+static void accept_pending(struct worker *w, struct listener *l)
+{
+    for (int n = 0; n < w->cfg->accept_batch; n++) {
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        int client_fd = accept4(l->fd, (struct sockaddr*)&peer, &peer_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if ((errno == EMFILE || errno == ENFILE) && accept_shed(w, l))
+                continue;
+            perror("accept4");
+            return;
+        }
+
+        struct conn *c = conn_new(w, l, client_fd);
+        if (!c) {
+            close(client_fd);
+            continue;
+        }
+        memcpy(&c->peer_addr, &peer, peer_len < sizeof(peer) ? peer_len : sizeof(peer));
+        c->peer_len = peer_len;
+
+        struct epoll_event ev = {
+            .events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = c,
+        };
+        if (epoll_ctl(w->ep, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            conn_free(c);
+            continue;
+        }
+        conn_arm(w, c);
+    }
+}
+
+/*------------------------------------------------------------
+ *  epoll event loop: every connection progresses
+ *  independently, so a slow or idle client never stalls the
+ *  others. Deadlines live in the worker's timer wheel; each
+ *  wakeup first closes whatever expired, and epoll_wait()
+ *  sleeps no longer than the next wheel tick.
+ *-----------------------------------------------------------*/
+static void epoll_loop(struct worker *w)
+{
+    struct epoll_event events[MAX_EVENTS];
+    while (keep_running) {
+        struct dlist expired;
+        dlist_init(&expired);
+        int timeout = tw_advance(&w->wheel, &expired);
+        for (struct conn *c; (c = conn_expired(&expired)); )
+            conn_free(c);
+
+        int n = epoll_wait(w->ep, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct ev_tag *t = (struct ev_tag*)events[i].data.ptr;
+            switch (t->kind) {
+                case EV_LISTENER:
+                    accept_pending(w, (struct listener*)t);
+                    break;
+                case EV_STOP:
+                    return;                    /* main saw SIGINT/SIGTERM */
+                case EV_CONN:
+                    if (conn_handle(w, (struct conn*)t) < 0)
+                        conn_free((struct conn*)t);
+                    else
+                        conn_arm(w, (struct conn*)t);
+                    break;
+            }
+        }
+    }
+}
+
+#ifdef SNOOZE_HAVE_IO_URING
+/*------------------------------------------------------------
+ *  io_uring engine (--engine=io_uring)
+ *
+ *  Talks to the kernel through the raw syscalls, so there is
+ *  no liburing dependency. Per request the kernel sees:
+ *    - one multishot ACCEPT shared by all connections,
+ *    - READ_FIXED into a registered slab slot (RECV for
+ *      slots past the registered ones and heap buffers),
+ *    - a bare SENDMSG while the connection is kept alive,
+ *    - for the last response, SENDMSG → SHUTDOWN → RECV(drain)
+ *      hard-linked in one submission; each drain completion
+ *      posts the next RECV until the lingering close is over
+ *      (EOF, LINGER_MAX_BYTES or --linger-timeout), then CLOSE,
+ *  and every SQE queued during a loop iteration goes out with
+ *  the same io_uring_enter() that waits for completions.
+ *-----------------------------------------------------------*/
+#define URING_ENTRIES   4096
+
+enum uring_op {                  /* low bits of user_data; the rest
+                                    is the conn (the listener for
+                                    ACCEPT, NULL for STOP/TICK)     */
+    OP_ACCEPT,
+    OP_STOP,
+    OP_RECV,
+    OP_SEND,                     /* keep-alive response            */
+    OP_LINK,                     /* chain members, cancels: ignored */
+    OP_CLOSE,
+    OP_TICK,                     /* timer wheel tick               */
+    OP_SEND_LAST,                /* final response; drain is linked */
+};
+#define OP_MASK 7u
+_Static_assert(_Alignof(struct conn) > OP_MASK && _Alignof(struct listener) > OP_MASK,
+               "user_data pointers must leave the op bits clear");
+
+struct uring {
+    int                  fd;
+    unsigned             sq_entries;
+    unsigned            *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned             sqe_tail;     /* local tail, published on submit */
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring, *cq_ring;
+    size_t               sq_ring_sz, cq_ring_sz, sqes_sz;
+
+    struct worker       *w;
+    char                 scratch[65536]; /* drain target, as big as discard_sink */
+    int                  no_multishot;   /* kernel rejected multishot ACCEPT */
+    struct __kernel_timespec tick;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static int uring_init(struct uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    u->fd = sys_io_uring_setup(entries, &p);
+    if (u->fd < 0 && errno == EINVAL) {        /* older kernel: plain ring */
+        memset(&p, 0, sizeof(p));
+        u->fd = sys_io_uring_setup(entries, &p);
+    }
+    if (u->fd < 0) return -1;
+
+    u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_sz = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_sz > u->sq_ring_sz) u->sq_ring_sz = u->cq_ring_sz;
+        u->cq_ring_sz = u->sq_ring_sz;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) goto fail;
+    }
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*)mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) goto fail;
+
+    char *sq = (char*)u->sq_ring, *cq = (char*)u->cq_ring;
+    u->sq_entries = p.sq_entries;
+    u->sq_head  = (unsigned*)(sq + p.sq_off.head);
+    u->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+    u->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(sq + p.sq_off.array);
+    u->cq_head  = (unsigned*)(cq + p.cq_off.head);
+    u->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+    u->cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    u->sqe_tail = *u->sq_tail;
+
+    /* identity-map the SQ index array once; SQEs are used in order */
+    for (unsigned i = 0; i < p.sq_entries; i++) u->sq_array[i] = i;
+    return 0;
+
+fail:
+    close(u->fd);
+    u->fd = -1;
+    return -1;
+}
+
+static void uring_exit(struct uring *u)
+{
+    munmap(u->sqes, u->sqes_sz);
+    if (u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_sz);
+    munmap(u->sq_ring, u->sq_ring_sz);
+    close(u->fd);
+}
+
+/*
+ * Checks every opcode the engine relies on (run once from main).
+ * Multishot ACCEPT has no probe flag of its own; it came in 5.19
+ * along with IORING_OP_SOCKET, which stands in for it here.
+ */
+static int uring_supported(void)
+{
+    struct uring u;
+    memset(&u, 0, sizeof(u));
+    if (uring_init(&u, 8) < 0) return 0;
+
+    static const int ops[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_READ_FIXED, IORING_OP_SENDMSG,
+        IORING_OP_SHUTDOWN, IORING_OP_CLOSE, IORING_OP_POLL_ADD, IORING_OP_TIMEOUT,
+        IORING_OP_SOCKET,
+    };
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe*)calloc(1, len);
+    int ok = probe && sys_io_uring_register(u.fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++)
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    uring_exit(&u);
+    return ok;
+}
+
+/*
+ * Registers the worker's slab slots as fixed buffers. Locked-memory
+ * limits vary, so the registered prefix shrinks until the kernel
+ * accepts it (or is skipped); later slots fall back to RECV.
+ */
+static void uring_register_slab(struct uring *u)
+{
+    struct conn_slab *s = &u->w->slab;
+    if (!s->base) return;
+
+    struct iovec *iov = (struct iovec*)malloc(CONN_SLAB_SLOTS * sizeof(*iov));
+    if (!iov) return;
+    for (int i = 0; i < CONN_SLAB_SLOTS; i++) {
+        iov[i].iov_base = s->base + (size_t)i * s->slot_size;
+        iov[i].iov_len  = s->slot_size;
+    }
+    for (int n = CONN_SLAB_SLOTS; n > 0; n /= 2) {
+        if (sys_io_uring_register(u->fd, IORING_REGISTER_BUFFERS, iov, (unsigned)n) == 0) {
+            s->registered = n;
+            break;
+        }
+    }
+    free(iov);
+}
+
+static int uring_submit(struct uring *u, unsigned wait)
+{
+    unsigned pending = u->sqe_tail - *u->sq_tail;
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+
+    for (;;) {
+        int r = sys_io_uring_enter(u->fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+        if (r >= 0 || errno != EINTR) return r;
+        if (!keep_running) return r;
+    }
+}
+
+/*
+ * Returns a zeroed SQE. Guarantees room for `need` consecutive
+ * SQEs so linked chains never straddle two submissions.
+ */
+static struct io_uring_sqe *uring_sqe(struct uring *u, unsigned need)
+{
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sqe_tail + need - head > u->sq_entries) {
+        uring_submit(u, 0);                    /* ring full: flush early */
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (u->sqe_tail + need - head > u->sq_entries) return NULL;
+    }
+    struct io_uring_sqe *sqe = &u->sqes[u->sqe_tail++ & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static inline uint64_t ud(const void *p, enum uring_op op)
+{
+    return (uint64_t)(uintptr_t)p | op;
+}
+
+static void uring_post_accept(struct uring *u, struct listener *l)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, 1);
+    if (!sqe) return;
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = l->fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data    = ud(l, OP_ACCEPT);
+}
+
+static void uring_post_stop(struct uring *u)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, 1);
+    if (!sqe) return;
+    sqe->opcode      = IORING_OP_POLL_ADD;
+    sqe->fd          = stop_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data   = ud(NULL, OP_STOP);
+}
+
+static void uring_post_tick(struct uring *u)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, 1);
+    if (!sqe) return;
+    u->tick.tv_sec  = 0;
+    u->tick.tv_nsec = TW_TICK_MS * 1000000L;
+    sqe->opcode    = IORING_OP_TIMEOUT;
+    sqe->fd        = -1;
+    sqe->addr      = (uint64_t)(uintptr_t)&u->tick;
+    sqe->len       = 1;
+    sqe->user_data = ud(NULL, OP_TICK);
+}
+
+/*
+ * Closes connections whose deadline passed. Each one has a RECV
+ * or SENDMSG in flight; shutting the socket down completes it
+ * (end of stream / EPIPE) and the usual close path takes over.
+ */
+static void uring_expire(struct uring *u)
+{
+    struct dlist expired;
+    dlist_init(&expired);
+    tw_advance(&u->w->wheel, &expired);
+    for (struct conn *c; (c = conn_expired(&expired)); ) {
+        c->closing = 1;
+        c->discard = 0;
+        shutdown(c->fd, SHUT_RDWR);
+    }
+}
+
+/*
+ * The timer goes now, not at the CQE: a tick reaped first must not
+ * shutdown() an fd that may already belong to a new connection.
+ */
+static void uring_post_close(struct uring *u, struct conn *c)
+{
+    c->state = CONN_CLOSING;
+    tw_cancel(&u->w->wheel, &c->timer);
+    c->phase = PHASE_NONE;                     /* conn_arm() keeps it off */
+
+    struct io_uring_sqe *sqe = uring_sqe(u, 1);
+    if (!sqe) { close(c->fd); conn_destroy(c); return; }
+    sqe->opcode    = IORING_OP_CLOSE;
+    sqe->fd        = c->fd;
+    sqe->user_data = ud(c, OP_CLOSE);
+}
+
+static void uring_post_drain(struct uring *u, struct io_uring_sqe *sqe, struct conn *c)
+{
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = c->fd;
+    sqe->addr      = (uint64_t)(uintptr_t)u->scratch;
+    sqe->len       = (unsigned)discard_chunk(c, c->linger);
+    sqe->msg_flags = MSG_TRUNC | (u->w->cfg->linger_timeout > 0 ? 0 : MSG_DONTWAIT);
+    sqe->user_data = ud(c, OP_RECV);
+}
+
+static void uring_post_recv(struct uring *u, struct conn *c)
+{
+    if (c->discard > 0) {                      /* unlogged body: drop it */
+        struct io_uring_sqe *sqe = uring_sqe(u, 1);
+        if (!sqe) { uring_post_close(u, c); return; }
+        sqe->opcode    = IORING_OP_RECV;
+        sqe->fd        = c->fd;
+        sqe->addr      = (uint64_t)(uintptr_t)u->scratch;
+        sqe->len       = (unsigned)discard_chunk(c, c->discard);
+        sqe->msg_flags = MSG_TRUNC;
+        sqe->user_data = ud(c, OP_RECV);
+        return;
+    }
+
+    size_t room;
+    char *dst = conn_recv_window(c, &room);
+    struct io_uring_sqe *sqe = dst ? uring_sqe(u, 1) : NULL;
+    if (!sqe) { uring_post_close(u, c); return; }
+
+    if (c->slot >= 0 && c->slot < c->slab->registered) {  /* fixed: no page pinning per read */
+        sqe->opcode    = IORING_OP_READ_FIXED;
+        sqe->buf_index = (uint16_t)c->slot;
+        sqe->off       = (uint64_t)-1;
+    } else {
+        sqe->opcode    = IORING_OP_RECV;
+    }
+    sqe->fd        = c->fd;
+    sqe->addr      = (uint64_t)(uintptr_t)dst;
+    sqe->len       = (unsigned)(room > UINT32_MAX ? UINT32_MAX : room);
+    sqe->user_data = ud(c, OP_RECV);
+}
+
+/*
+ * SHUTDOWN → RECV(drain) for a lingering close; every drain
+ * completion posts the next RECV until conn_lingered() says done,
+ * then the CLOSE. Without --linger-timeout the RECV only takes
+ * what is already queued, like graceful_close().
+ */
+static void uring_post_linger(struct uring *u, struct conn *c)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, 2);
+    if (!sqe) { uring_post_close(u, c); return; }
+    sqe->opcode    = IORING_OP_SHUTDOWN;
+    sqe->fd        = c->fd;
+    sqe->len       = SHUT_WR;
+    sqe->flags     = IOSQE_IO_HARDLINK;
+    sqe->user_data = ud(c, OP_LINK);
+    uring_post_drain(u, uring_sqe(u, 1), c);
+}
+
+/*
+ * Every queued response goes out in one SENDMSG. Keep-alive (or a
+ * body still to discard): its completion resumes reading. Otherwise
+ * SENDMSG → SHUTDOWN → drain in one hard-linked chain.
+ */
+static void uring_post_response(struct uring *u, struct conn *c)
+{
+    int chain = c->closing && c->discard == 0;
+    struct io_uring_sqe *sqe = uring_sqe(u, chain ? 3 : 1);
+    if (!sqe) { uring_post_close(u, c); return; }
+
+    c->msg.msg_iov    = c->out;
+    c->msg.msg_iovlen = (size_t)c->out_cnt;
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = c->fd;
+    sqe->addr      = (uint64_t)(uintptr_t)&c->msg;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    if (!chain) {
+        sqe->user_data = ud(c, OP_SEND);
+        return;
+    }
+    sqe->flags     = IOSQE_IO_HARDLINK;
+    sqe->user_data = ud(c, OP_SEND_LAST);
+
+    conn_start_linger(c);                      /* its deadline starts once sent */
+    uring_post_linger(u, c);
+}
+
+/* Answers whatever is buffered, or goes back to reading */
+static void uring_advance(struct uring *u, struct conn *c)
+{
+    if (conn_process(u->w, c)) {
+        conn_arm(u->w, c);
+        uring_post_response(u, c);
+    } else if (c->eof) {
+        uring_post_close(u, c);
+    } else if (conn_done(c)) {
+        conn_start_linger(c);
+        conn_arm(u->w, c);
+        uring_post_linger(u, c);
+    } else {
+        conn_arm(u->w, c);
+        uring_post_recv(u, c);
+    }
+}
+
+/* Returns 0 to keep going, -1 to leave the loop (stop eventfd, or
+ * a kernel without multishot ACCEPT: see u->no_multishot) */
+static int uring_complete(struct uring *u, const struct io_uring_cqe *cqe)
+{
+    void *p = (void*)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+    struct conn *c = (struct conn*)p;
+
+    switch ((enum uring_op)(cqe->user_data & OP_MASK)) {
+        case OP_ACCEPT: {
+            struct listener *l = (struct listener*)p;
+            int hard = 0;
+            if (cqe->res >= 0) {
+                struct conn *nc = conn_new(u->w, l, cqe->res);
+                if (nc) { conn_arm(u->w, nc); uring_post_recv(u, nc); }
+                else    close(cqe->res);
+            } else if (cqe->res == -EINVAL && !(cqe->flags & IORING_CQE_F_MORE)) {
+                u->no_multishot = 1;           /* 5.10-5.18 refuse the ioprio flag */
+                return -1;
+            } else if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+                accept_shed(u->w, l);
+                hard = 1;
+            } else if (cqe->res != -EINTR && cqe->res != -EAGAIN &&
+                       cqe->res != -ECANCELED && cqe->res != -ECONNABORTED) {
+                fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+                hard = 1;
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {   /* multishot ended */
+                if (hard) l->parked = 1;       /* re-armed by the next tick */
+                else      uring_post_accept(u, l);
+            }
+            return 0;
+        }
+
+        case OP_STOP:
+            return -1;
+
+        case OP_RECV:
+            if (c->state == CONN_LINGER) {
+                if (cqe->res > 0 && u->w->cfg->linger_timeout > 0 &&
+                    !conn_lingered(c, (size_t)cqe->res)) {
+                    struct io_uring_sqe *sqe = uring_sqe(u, 1);
+                    if (sqe) { uring_post_drain(u, sqe, c); return 0; }
+                }
+                uring_post_close(u, c);
+                return 0;
+            }
+            if (cqe->res < 0) {
+                if (cqe->res == -EINTR || cqe->res == -EAGAIN) uring_post_recv(u, c);
+                else                                           uring_post_close(u, c);
+                return 0;
+            }
+            if (c->discard > 0) conn_discarded(c, (size_t)cqe->res);
+            else                conn_received(c, (size_t)cqe->res);
+            uring_advance(u, c);
+            return 0;
+
+        case OP_SEND:                          /* keep-alive responses are out */
+            if (cqe->res <= 0) {
+                uring_post_close(u, c);
+                return 0;
+            }
+            metric_add(&c->m->bytes_out, (size_t)cqe->res);
+            conn_consume(c, (size_t)cqe->res);
+            if (c->out_cnt > 0) {              /* short send: the rest again */
+                c->progress = 1;
+                conn_arm(u->w, c);
+                uring_post_response(u, c);
+                return 0;
+            }
+            conn_sent(c);
+            uring_advance(u, c);
+            return 0;
+
+        case OP_SEND_LAST:                     /* the linked drain closes c */
+            if (cqe->res >= 0) {
+                metric_add(&c->m->bytes_out, (size_t)cqe->res);
+                conn_sent(c);
+            }
+            c->out_cnt = 0;
+            conn_arm(u->w, c);
+            return 0;
+
+        case OP_LINK:                          /* intermediate links: nothing to do */
+            return 0;
+
+        case OP_TICK:
+            uring_expire(u);
+            for (int i = 0; i < u->w->nlisteners; i++) {
+                struct listener *l = &u->w->listeners[i];
+                if (l->parked) { l->parked = 0; uring_post_accept(u, l); }
+            }
+            uring_post_tick(u);
+            return 0;
+
+        case OP_CLOSE:
+            if (cqe->res == -ECANCELED) close(c->fd);
+            conn_destroy(c);
+            return 0;
+    }
+    return 0;
+}
+
+/* Returns -1 if io_uring could not be set up or lacks multishot
+ * ACCEPT (caller falls back to epoll, listeners already added) */
+static int uring_loop(struct worker *w)
+{
+    struct uring *u = (struct uring*)calloc(1, sizeof(*u));
+    if (!u) return -1;
+    if (uring_init(u, URING_ENTRIES) < 0) {
+        fprintf(stderr, "worker %d: io_uring_setup: %s\n", w->id, strerror(errno));
+        free(u);
+        return -1;
+    }
+    u->w = w;
+    uring_register_slab(u);
+
+    /* io_uring waits on its own; a blocking listener lets multishot
+     * accept park in the kernel instead of bouncing with EAGAIN. */
+    for (int i = 0; i < w->nlisteners; i++) {
+        struct listener *l = &w->listeners[i];
+        int flags = fcntl(l->fd, F_GETFL, 0);
+        if (flags >= 0 && !l->shared)          /* shared: epoll workers may use it */
+            fcntl(l->fd, F_SETFL, flags & ~O_NONBLOCK);
+        uring_post_accept(u, l);
+    }
+    uring_post_stop(u);
+    uring_post_tick(u);
+
+    int stopping = 0;
+    while (keep_running && !stopping) {
+        if (uring_submit(u, 1) < 0 && errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter");
+            break;
+        }
+
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            if (uring_complete(u, &u->cqes[head & *u->cq_mask]) < 0) stopping = 1;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    int fallback = u->no_multishot;
+    uring_exit(u);
+    free(u);
+    if (!fallback) return 0;
+
+    fprintf(stderr, "worker %d: no multishot accept; falling back to epoll\n", w->id);
+    for (int i = 0; i < w->nlisteners; i++) {
+        int flags = fcntl(w->listeners[i].fd, F_GETFL, 0);
+        if (flags >= 0) fcntl(w->listeners[i].fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    w->slab.registered = 0;                    /* gone with the ring */
+    return -1;
+}
+#endif /* SNOOZE_HAVE_IO_URING */
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = (struct worker*)arg;
+
+    if (w->cfg->pin && !w->admin) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET((int)(w->id % (ncpu > 0 ? ncpu : 1)), &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0)
+            fprintf(stderr, "worker %d: pthread_setaffinity_np: %s\n", w->id, strerror(err));
+    }
+
+    /* allocated here, after pinning, so the slab is local to this CPU */
+    slab_init(&w->slab, conn_buf_size(w->cfg));
+
+#ifdef SNOOZE_HAVE_IO_URING
+    if (w->cfg->engine == ENGINE_IO_URING && !w->admin && uring_loop(w) == 0) {
+        slab_destroy(&w->slab);
+        return NULL;
+    }
+#endif
+    epoll_loop(w);                             /* the admin listener always uses epoll */
+    slab_destroy(&w->slab);
+    return NULL;
+}
+
+/*------------------------------------------------------------
+ *  Main: set up listeners, start workers, wait for a signal
+ *-----------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    struct config cfg;
+
+    /* Parse environment variables and CLI flags */
+    parse_arguments(argc, argv, &cfg);
+
+    /* Set up signals; workers inherit a mask with them blocked so
+     * only the main thread (in sigsuspend below) ever handles them. */
+    struct sigaction sa = { .sa_handler = handle_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);                  /* sendfile() to a closed peer */
+
+    sigset_t block, orig;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &orig);
+
+#ifdef SNOOZE_HAVE_IO_URING
+    if (cfg.engine == ENGINE_IO_URING && !uring_supported()) {
+        fprintf(stderr, "io_uring unavailable; falling back to epoll\n");
+        cfg.engine = ENGINE_EPOLL;
+    }
+#else
+    if (cfg.engine == ENGINE_IO_URING) {
+        fprintf(stderr, "built without io_uring support; falling back to epoll\n");
+        cfg.engine = ENGINE_EPOLL;
+    }
+#endif
+
+    stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stop_fd < 0) { perror("eventfd"); exit(EXIT_FAILURE); }
+
+    /* one extra event loop for --metrics-port, after the workers */
+    int nthreads = cfg.workers + (cfg.metrics_port > 0);
+    struct worker *workers = (struct worker*)calloc((size_t)nthreads, sizeof(*workers));
+    if (!workers) { perror("calloc"); exit(EXIT_FAILURE); }
+
+    metrics_count = nthreads;
+    metrics = (struct metrics*)aligned_alloc(CACHE_LINE, (size_t)nthreads * sizeof(*metrics));
+    if (!metrics) { perror("aligned_alloc"); exit(EXIT_FAILURE); }
+    memset(metrics, 0, (size_t)nthreads * sizeof(*metrics));
+
+    struct listen_addr admin_addr;
+    if (cfg.metrics_port > 0) {
+        char spec[16];
+        snprintf(spec, sizeof(spec), "*:%d", cfg.metrics_port);
+        parse_listen(spec, &admin_addr);
+    }
+
+    /* A unix path binds once: its socket is shared by every worker */
+    int shared_fd[MAX_LISTEN];
+    for (int j = 0; j < cfg.nlisten; j++) {
+        shared_fd[j] = -1;
+        if (cfg.listen[j].ss.ss_family == AF_UNIX &&
+            (shared_fd[j] = open_listener(&cfg, &cfg.listen[j])) < 0)
+            exit(EXIT_FAILURE);
+    }
+
+    /* Create every listener up front so bind errors exit cleanly */
+    for (int i = 0; i < nthreads; i++) {
+        struct worker *w = &workers[i];
+        w->id    = i;
+        w->cfg   = &cfg;
+        w->admin = i == cfg.workers;
+        w->m     = &metrics[i];
+        tw_init(&w->wheel);
+        w->log_refill_ms = now_ms();
+        w->log_tokens    = 1.0;
+
+        w->ep = epoll_create1(EPOLL_CLOEXEC);
+        if (w->ep < 0) { perror("epoll_create1"); exit(EXIT_FAILURE); }
+
+        w->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+        /* every address in the same loop; the admin one is dual-stack */
+        const struct listen_addr *addrs = w->admin ? &admin_addr : cfg.listen;
+        w->nlisteners = w->admin ? 1 : cfg.nlisten;
+        for (int j = 0; j < w->nlisteners; j++) {
+            struct listener *l = &w->listeners[j];
+            l->tag.kind  = EV_LISTENER;
+            l->unix_sock = addrs[j].ss.ss_family == AF_UNIX;
+            l->shared    = l->unix_sock;
+            l->fd = l->shared ? shared_fd[j] : open_listener(&cfg, &addrs[j]);
+            if (l->fd < 0) exit(EXIT_FAILURE);
+
+            /* a shared socket wakes one worker per connection, not all */
+            struct epoll_event lev = { .events = EPOLLIN | (l->shared ? EPOLLEXCLUSIVE : 0),
+                                       .data.ptr = l };
+            if (epoll_ctl(w->ep, EPOLL_CTL_ADD, l->fd, &lev) < 0) {
+                perror("epoll_ctl"); exit(EXIT_FAILURE);
+            }
+        }
+
+        struct epoll_event sev = { .events = EPOLLIN, .data.ptr = &stop_tag };
+        if (epoll_ctl(w->ep, EPOLL_CTL_ADD, stop_fd, &sev) < 0) {
+            perror("epoll_ctl"); exit(EXIT_FAILURE);
+        }
+    }
+
+    /* accept-queue overflows since startup are reported on exit */
+    unsigned long long overflows0 = 0, drops0 = 0, overflows, drops;
+    int have_overflows = read_listen_overflows(&overflows0, &drops0) == 0;
+
+    scan_init();
+    char  *file_message = NULL;
+    size_t file_len = 0;
+    if (cfg.message_file && load_message_file(cfg.message_file, &file_message, &file_len) < 0)
+        exit(EXIT_FAILURE);
+    if (file_message) {
+        if (build_responses(file_message, file_len) < 0) exit(EXIT_FAILURE);
+        free(file_message);
+    } else if (build_responses(cfg.message, strlen(cfg.message)) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (log_start(cfg.log_overflow) < 0) exit(EXIT_FAILURE);
+
+    printf("snooze is listening on");
+    for (int i = 0; i < cfg.nlisten; i++) {
+        char name[ADDR_NAME_MAX];
+        printf("%s %s", i ? "," : "",
+               format_sockaddr(&cfg.listen[i].ss, cfg.listen[i].len, name, sizeof(name)));
+    }
+    printf(" (%d worker%s, %s)\n", cfg.workers, cfg.workers == 1 ? "" : "s",
+           cfg.engine == ENGINE_IO_URING ? "io_uring" : "epoll");
+    if (cfg.metrics_port > 0)
+        printf("snooze serves metrics on port %d\n", cfg.metrics_port);
+
+    for (int i = 0; i < nthreads; i++) {
+        int err = pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Sleep until SIGINT/SIGTERM, then wake every worker */
+    while (keep_running)
+        sigsuspend(&orig);
+
+    uint64_t one = 1;
+    if (write(stop_fd, &one, sizeof(one)) < 0) perror("write");
+
+    unsigned long suppressed = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        suppressed += workers[i].log_suppressed;
+        close(workers[i].ep);
+        for (int j = 0; j < workers[i].nlisteners; j++)
+            if (!workers[i].listeners[j].shared) close(workers[i].listeners[j].fd);
+        if (workers[i].spare_fd >= 0) close(workers[i].spare_fd);
+    }
+
+    /* Clean up */
+    for (int j = 0; j < cfg.nlisten; j++) {
+        if (shared_fd[j] < 0) continue;
+        close(shared_fd[j]);
+        const char *path = ((const struct sockaddr_un*)&cfg.listen[j].ss)->sun_path;
+        if (path[0]) unlink(path);
+    }
+    log_stop();
+    if (have_overflows && read_listen_overflows(&overflows, &drops) == 0 && overflows > overflows0)
+        fprintf(stderr, "accept queues overflowed %llu times while snooze ran "
+                        "(%llu connections dropped); consider a larger --backlog\n",
+                overflows - overflows0, drops - drops0);
+    if (suppressed > 0)
+        fprintf(stderr, "snooze suppressed %lu request dumps (sampling)\n", suppressed);
+    close(stop_fd);
+    free(workers);
+    free(metrics);
+    free_responses();
     printf("snooze received stop signal; shutting down...\n");
     return 0;
 }